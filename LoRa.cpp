@@ -3,6 +3,7 @@
 // license information.
 
 #include <LoRa.h>
+#include <LoRaCapture.h>
 
 // registers
 #define REG_FIFO                 0x00
@@ -23,6 +24,7 @@
 #define REG_PKT_RSSI_VALUE       0x1a
 #define REG_MODEM_CONFIG_1       0x1d
 #define REG_MODEM_CONFIG_2       0x1e
+#define REG_SYMB_TIMEOUT_LSB     0x1f
 #define REG_PREAMBLE_MSB         0x20
 #define REG_PREAMBLE_LSB         0x21
 #define REG_PAYLOAD_LENGTH       0x22
@@ -48,33 +50,47 @@
 #define MODE_TX              0x03
 #define MODE_RX_CONTINUOUS   0x05
 #define MODE_RX_SINGLE       0x06
+#define MODE_MASK            0x07
 
 // PA config
 #define PA_BOOST 0x80
 
 // IRQ masks
 #define IRQ_TX_DONE_MASK           0x08
+#define IRQ_VALID_HEADER_MASK      0x10
 #define IRQ_PAYLOAD_CRC_ERROR_MASK 0x20
 #define IRQ_RX_DONE_MASK           0x40
+#define IRQ_RX_TIMEOUT_MASK        0x80
 
 #define MAX_PKT_LENGTH     255
 #define RSSI_OFFSET_LF     -164.0
 #define RSSI_OFFSET_HF     -157.0
 #define RF_MID_BAND_THRESH 525000000
 
+// receiver start-up plus a few wideband RSSI updates after entering RX
+#define RSSI_SETTLE_US 1000
+// spacing of wideband RSSI samples, back-to-back SPI reads mostly see the
+// same register value
+#define RSSI_SAMPLE_US 1000
+
 LoRaPort::LoRaPort(PinName spi_mosi, PinName spi_miso, PinName spi_sclk,
-                   PinName nss, PinName reset, PinName dio0)
+                   PinName nss, PinName reset, PinName dio0, PinName dio1)
     : _ss(nss),
       _reset(reset),
       _dio0(dio0),
+      _dio1(NULL),
       _frequency(0),
       _packetIndex(0),
       _implicitHeaderMode(0),
       _onReceive(NULL),
       _onTxDone(NULL),
+      _onRxSingle(NULL),
       lora_thread(osPriorityRealtime, OS_STACK_SIZE, NULL, "LR-SX1276"),
       queue(32 * EVENTS_EVENT_SIZE) {
     _spi = new SPI(spi_mosi, spi_miso, spi_sclk);
+    if (dio1 != NC) {
+        _dio1 = new InterruptIn(dio1);
+    }
     //   // SPI bus frequency
     uint32_t spi_freq = LORA_DEFAULT_SPI_FREQUENCY;
 
@@ -93,6 +109,7 @@ LoRaPort::LoRaPort(PinName spi_mosi, PinName spi_miso, PinName spi_sclk,
 
 LoRaPort::~LoRaPort() {
     delete _spi;
+    delete _dio1;
 }
 
 uint8_t LoRaPort::begin(long frequency) {
@@ -133,6 +150,7 @@ uint8_t LoRaPort::begin(long frequency) {
 
     // put in standby mode
     lora_idle();
+    _clock.start();
     lora_thread.start(callback(&queue, &EventQueue::dispatch_forever));
     return 1;
 }
@@ -244,16 +262,40 @@ int16_t LoRaPort::parsePacket(uint8_t size) {
     return packetLength;
 }
 
+us_timestamp_t LoRaPort::packetTimestamp() {
+    if (_replayRecord) {
+        return _replayRecord->timestamp_us;
+    }
+
+    return _dio0Timestamp;
+}
+
+us_timestamp_t LoRaPort::timestamp() {
+    return _clock.read_high_resolution_us();
+}
+
 int16_t LoRaPort::packetRssi() {
+    if (_replayRecord) {
+        return _replayRecord->rssi;
+    }
+
     return (readRegister(REG_PKT_RSSI_VALUE) -
             (_frequency < 868E6 ? 164 : 157));
 }
 
 float LoRaPort::packetSnr() {
+    if (_replayRecord) {
+        return _replayRecord->snr * 0.25;
+    }
+
     return ((int8_t)readRegister(REG_PKT_SNR_VALUE)) * 0.25;
 }
 
 long LoRaPort::packetFrequencyError() {
+    if (_replayRecord) {
+        return _replayRecord->frequency_error;
+    }
+
     int32_t freqError = 0;
     freqError =
         static_cast<int32_t>(readRegister(REG_FREQ_ERROR_MSB) & 7);  // B111
@@ -299,6 +341,10 @@ size_t LoRaPort::write(const uint8_t *buffer, size_t size) {
 }
 
 int16_t LoRaPort::available() {
+    if (_replayRecord) {
+        return (_replayRecord->length - _packetIndex);
+    }
+
     return (readRegister(REG_RX_NB_BYTES) - _packetIndex);
 }
 
@@ -307,6 +353,10 @@ int16_t LoRaPort::read() {
         return -1;
     }
 
+    if (_replayRecord) {
+        return _replayPayload[_packetIndex++];
+    }
+
     _packetIndex++;
 
     return readRegister(REG_FIFO);
@@ -317,6 +367,10 @@ int16_t LoRaPort::peek() {
         return -1;
     }
 
+    if (_replayRecord) {
+        return _replayPayload[_packetIndex];
+    }
+
     // store current FIFO address
     uint8_t currentAddress = readRegister(REG_FIFO_ADDR_PTR);
 
@@ -333,7 +387,7 @@ void LoRaPort::onReceive(Callback<void(uint16_t)> cb) {
     _onReceive = cb;
 
     if (cb) {
-        _dio0.rise(queue.event(callback(this, &LoRaPort::handleDio0Rise)));
+        _dio0.rise(callback(this, &LoRaPort::dio0Isr));
     } else {
         _dio0.rise(nullptr);
     }
@@ -343,7 +397,7 @@ void LoRaPort::onTxDone(Callback<void()> cb) {
     _onTxDone = cb;
 
     if (cb) {
-        _dio0.rise(queue.event(callback(this, &LoRaPort::handleDio0Rise)));
+        _dio0.rise(callback(this, &LoRaPort::dio0Isr));
     } else {
         _dio0.rise(nullptr);
     }
@@ -363,6 +417,63 @@ void LoRaPort::receive(uint8_t size) {
 }
 // #endif
 
+uint8_t LoRaPort::receiveSingle(uint16_t timeout_symbols,
+                                Callback<void(int16_t)> cb, uint8_t size) {
+    if (isTransmitting()) {
+        return 0;
+    }
+
+    if (timeout_symbols < 4) {
+        timeout_symbols = 4;
+    } else if (timeout_symbols > 1023) {
+        timeout_symbols = 1023;
+    }
+
+    lora_idle();
+
+    if (_rxTimeoutEvent) {
+        queue.cancel(_rxTimeoutEvent);
+        _rxTimeoutEvent = 0;
+    }
+    _onRxSingle = cb;
+
+    if (size > 0) {
+        implicitHeaderMode();
+
+        writeRegister(REG_PAYLOAD_LENGTH, size & 0xff);
+    } else {
+        explicitHeaderMode();
+    }
+
+    // SymbTimeout(9:8) lives in the low bits of REG_MODEM_CONFIG_2
+    writeRegister(REG_MODEM_CONFIG_2,
+                  (readRegister(REG_MODEM_CONFIG_2) & 0xfc) |
+                      ((timeout_symbols >> 8) & 0x03));
+    writeRegister(REG_SYMB_TIMEOUT_LSB, timeout_symbols & 0xff);
+
+    // DIO0 => RXDONE, DIO1 => RXTIMEOUT, DIO3 => VALIDHEADER
+    writeRegister(REG_DIO_MAPPING_1, 0x01);
+
+    // drop flags left over from an earlier window
+    writeRegister(REG_IRQ_FLAGS, 0xff);
+    writeRegister(REG_FIFO_ADDR_PTR, 0);
+
+    _dio0.rise(callback(this, &LoRaPort::dio0Isr));
+    if (_dio1) {
+        _dio1->rise(queue.event(callback(this, &LoRaPort::handleDio1Rise)));
+    } else {
+        // no DIO1 wired: look at the flags once the window should have shut
+        float    ts = (1 << _datarate) / _bandwidth;
+        uint32_t window_ms = ceil(timeout_symbols * ts * 1000) + 1;
+        _rxTimeoutEvent =
+            queue.call_in(window_ms, this, &LoRaPort::handleDio1Rise);
+    }
+
+    writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_RX_SINGLE);
+
+    return 1;
+}
+
 void LoRaPort::lora_idle() {
     writeRegister(REG_OP_MODE, MODE_LONG_RANGE_MODE | MODE_STDBY);
 }
@@ -580,7 +691,53 @@ void LoRaPort::setOCP(uint8_t mA) {
 }
 
 uint32_t LoRaPort::random() {
-    return readRegister(REG_RSSI_WIDEBAND);
+    uint8_t noise[4];
+
+    if (!randomNoise(noise, sizeof(noise))) {
+        // radio busy, fall back to whole register reads in the current mode
+        for (uint8_t i = 0; i < sizeof(noise); i++) {
+            noise[i] = readRegister(REG_RSSI_WIDEBAND);
+            wait_us(RSSI_SAMPLE_US);
+        }
+    }
+
+    return ((uint32_t)noise[0] << 24) | ((uint32_t)noise[1] << 16) |
+           ((uint32_t)noise[2] << 8) | noise[3];
+}
+
+bool LoRaPort::randomNoise(uint8_t *buffer, size_t size) {
+    uint8_t opMode = readRegister(REG_OP_MODE);
+    uint8_t mode = opMode & MODE_MASK;
+
+    // leaving TX, a single receive or CAD would lose the operation
+    if (mode != MODE_SLEEP && mode != MODE_STDBY &&
+        mode != MODE_RX_CONTINUOUS) {
+        return false;
+    }
+
+    // wideband RSSI only carries noise once the receiver has settled
+    if (mode != MODE_RX_CONTINUOUS) {
+        if (mode == MODE_SLEEP) {
+            writeRegister(REG_OP_MODE, (opMode & ~MODE_MASK) | MODE_STDBY);
+        }
+        writeRegister(REG_OP_MODE, (opMode & ~MODE_MASK) | MODE_RX_CONTINUOUS);
+        wait_us(RSSI_SETTLE_US);
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        uint8_t b = 0;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            b = (b << 1) | (readRegister(REG_RSSI_WIDEBAND) & 0x01);
+            wait_us(RSSI_SAMPLE_US);
+        }
+        buffer[i] = b;
+    }
+
+    if (mode != MODE_RX_CONTINUOUS) {
+        writeRegister(REG_OP_MODE, opMode);
+    }
+
+    return true;
 }
 
 void LoRaPort::setSPIFrequency(uint32_t frequency) {
@@ -641,6 +798,59 @@ bool LoRaPort::channelActive(int16_t  rssi_threshold,
     return status;
 }
 
+EventQueue* LoRaPort::eventQueue() {
+    return &queue;
+}
+
+bool LoRaPort::onDriverThread() {
+    return ThisThread::get_id() == lora_thread.get_id();
+}
+
+void LoRaPort::setCapture(LoRaCapture* capture) {
+    _capture = capture;
+}
+
+bool LoRaPort::injectPacket(const LoRaTraceRecord& record,
+                            const uint8_t*         payload) {
+    if (onDriverThread()) {
+        // already on the driver thread, waiting on the queue would deadlock
+        handleInject(&record, payload, NULL);
+        return true;
+    }
+
+    // serialised with handleDio0Rise() so a live frame and a replayed one
+    // never share the read() state
+    Semaphore done(0, 1);
+    if (!queue.call(this, &LoRaPort::handleInject, &record, payload, &done)) {
+        return false;
+    }
+    done.acquire();
+
+    return true;
+}
+
+void LoRaPort::handleInject(const LoRaTraceRecord* record,
+                            const uint8_t* payload, Semaphore* done) {
+    // same filtering as handleDio0Rise()
+    if ((record->irq_flags & IRQ_PAYLOAD_CRC_ERROR_MASK) == 0 &&
+        (record->irq_flags & IRQ_RX_DONE_MASK) != 0) {
+        _replayRecord = record;
+        _replayPayload = payload;
+        _packetIndex = 0;
+
+        if (_onReceive) {
+            _onReceive(record->length);
+        }
+
+        _replayRecord = nullptr;
+        _replayPayload = nullptr;
+    }
+
+    if (done) {
+        done->release();
+    }
+}
+
 int16_t LoRaPort::getRssi() {
     int16_t rssi = -1;
     if (_frequency > RF_MID_BAND_THRESH) {
@@ -651,12 +861,28 @@ int16_t LoRaPort::getRssi() {
     return rssi;
 }
 
+void LoRaPort::dio0Isr() {
+    // stamp here, the event below may run well after the edge
+    _dio0Timestamp = _clock.read_high_resolution_us();
+    queue.call(this, &LoRaPort::handleDio0Rise);
+}
+
 void LoRaPort::handleDio0Rise() {
     uint8_t irqFlags = readRegister(REG_IRQ_FLAGS);
 
     // clear IRQ's
     writeRegister(REG_IRQ_FLAGS, irqFlags);
 
+    if (_capture && (irqFlags & IRQ_RX_DONE_MASK) != 0) {
+        // CRC failures are recorded too
+        capturePacket(irqFlags);
+    }
+
+    if (_onRxSingle && (irqFlags & IRQ_RX_DONE_MASK) != 0) {
+        completeRxSingle(irqFlags);
+        return;
+    }
+
     if ((irqFlags & IRQ_PAYLOAD_CRC_ERROR_MASK) == 0) {
         if ((irqFlags & IRQ_RX_DONE_MASK) != 0) {
             // received a packet
@@ -685,6 +911,93 @@ void LoRaPort::handleDio0Rise() {
     }
 }
 
+void LoRaPort::handleDio1Rise() {
+    _rxTimeoutEvent = 0;
+
+    if (!_onRxSingle) {
+        return;
+    }
+
+    uint8_t irqFlags = readRegister(REG_IRQ_FLAGS);
+
+    if (irqFlags & IRQ_RX_TIMEOUT_MASK) {
+        writeRegister(REG_IRQ_FLAGS, IRQ_RX_TIMEOUT_MASK);
+        completeRxSingle(irqFlags);
+    } else if (!_dio1 &&
+               (irqFlags & (IRQ_VALID_HEADER_MASK | IRQ_RX_DONE_MASK)) == 0) {
+        // polling fallback fired before the modem gave up, check again
+        _rxTimeoutEvent = queue.call_in(1, this, &LoRaPort::handleDio1Rise);
+    }
+    // a valid header means a packet is arriving, RxDone follows on DIO0
+}
+
+void LoRaPort::completeRxSingle(uint8_t irqFlags) {
+    Callback<void(int16_t)> cb = _onRxSingle;
+    _onRxSingle = nullptr;
+
+    if (_rxTimeoutEvent) {
+        queue.cancel(_rxTimeoutEvent);
+        _rxTimeoutEvent = 0;
+    }
+
+    if (irqFlags & IRQ_RX_TIMEOUT_MASK) {
+        cb(LORA_RX_TIMEOUT);
+        return;
+    }
+
+    if (irqFlags & IRQ_PAYLOAD_CRC_ERROR_MASK) {
+        cb(LORA_RX_CRC_ERROR);
+        return;
+    }
+
+    // received a packet
+    _packetIndex = 0;
+
+    // read packet length
+    uint8_t packetLength = _implicitHeaderMode
+                               ? readRegister(REG_PAYLOAD_LENGTH)
+                               : readRegister(REG_RX_NB_BYTES);
+
+    // set FIFO address to current RX address
+    writeRegister(REG_FIFO_ADDR_PTR, readRegister(REG_FIFO_RX_CURRENT_ADDR));
+
+    cb(packetLength);
+
+    // reset FIFO address
+    writeRegister(REG_FIFO_ADDR_PTR, 0);
+}
+
+void LoRaPort::capturePacket(uint8_t irqFlags) {
+    LoRaTraceRecord record;
+    uint8_t         payload[MAX_PKT_LENGTH];
+
+    // RxDone as stamped in the ISR, not when this event got to run
+    record.timestamp_us = _dio0Timestamp;
+    record.length = _implicitHeaderMode ? readRegister(REG_PAYLOAD_LENGTH)
+                                        : readRegister(REG_RX_NB_BYTES);
+    record.frequency = _frequency;
+    record.frequency_error = packetFrequencyError();
+    record.rssi = packetRssi();
+    record.snr = (int8_t)readRegister(REG_PKT_SNR_VALUE);
+    record.irq_flags = irqFlags;
+    record.spreading_factor = _datarate;
+    record.coding_rate = _coderate;
+    record.bandwidth = _bandwidth;
+    record.flags = (_crc_on ? LORA_TRACE_FLAG_CRC_ON : 0) |
+                   (_implicitHeaderMode ? LORA_TRACE_FLAG_IMPLICIT_HEADER : 0);
+    record.preamble_length = _preamble_len;
+
+    // read the payload without disturbing the FIFO pointer
+    uint8_t currentAddress = readRegister(REG_FIFO_ADDR_PTR);
+    writeRegister(REG_FIFO_ADDR_PTR, readRegister(REG_FIFO_RX_CURRENT_ADDR));
+    for (uint8_t i = 0; i < record.length; i++) {
+        payload[i] = readRegister(REG_FIFO);
+    }
+    writeRegister(REG_FIFO_ADDR_PTR, currentAddress);
+
+    _capture->append(record, payload);
+}
+
 uint8_t LoRaPort::readRegister(uint8_t address) {
     return singleTransfer(address & 0x7f, 0x00);
 }
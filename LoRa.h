@@ -17,12 +17,18 @@
 #include "mbed.h"
 #include "mbed_wait_api.h"
 
+#include "LoRaTrace.h"
+
 #if DEVICE_LPTICKER
     #include "LowPowerTimeout.h"
+    #include "LowPowerTimer.h"
     #define ALIAS_LORAWAN_TIMER mbed::LowPowerTimeout
+    #define ALIAS_LORAWAN_CLOCK mbed::LowPowerTimer
 #else
     #include "Timeout.h"
+    #include "Timer.h"
     #define ALIAS_LORAWAN_TIMER mbed::Timeout
+    #define ALIAS_LORAWAN_CLOCK mbed::Timer
 #endif
 
 #define LORA_DEFAULT_SPI_FREQUENCY 8E6
@@ -33,11 +39,17 @@
 #define LOW  0
 #define HIGH 1
 
+// receiveSingle() completion codes, non-negative values are packet lengths
+#define LORA_RX_TIMEOUT   -1
+#define LORA_RX_CRC_ERROR -2
+
+class LoRaCapture;
+
 class LoRaPort {
    public:
     // TODO: SPI pass in option
     LoRaPort(PinName spi_mosi, PinName spi_miso, PinName spi_sclk, PinName nss,
-             PinName reset, PinName dio0);
+             PinName reset, PinName dio0, PinName dio1 = NC);
     ~LoRaPort();
 
     uint8_t begin(long frequency);
@@ -51,6 +63,12 @@ class LoRaPort {
     float   packetSnr();
     long    packetFrequencyError();
 
+    // time of the last DIO0 rise (RxDone/TxDone) in us, taken in the ISR;
+    // the recorded value, on the capturing device's clock, while replaying
+    us_timestamp_t packetTimestamp();
+    // clock packetTimestamp() is measured against, runs from begin()
+    us_timestamp_t timestamp();
+
     // from Print
     virtual size_t write(uint8_t byte);
     virtual size_t write(const uint8_t* buffer, size_t size);
@@ -64,6 +82,12 @@ class LoRaPort {
     void onTxDone(Callback<void()> cb);
 
     void receive(uint8_t size = 0);
+    // one RX_SINGLE window closing after timeout_symbols (4 - 1023) without a
+    // preamble; cb gets the packet length, LORA_RX_TIMEOUT or
+    // LORA_RX_CRC_ERROR on the driver thread. Returns 0, without calling cb,
+    // while a transmission is in progress
+    uint8_t receiveSingle(uint16_t timeout_symbols, Callback<void(int16_t)> cb,
+                          uint8_t size = 0);
 
     void lora_idle();
     void lora_sleep();
@@ -82,17 +106,41 @@ class LoRaPort {
     void setOCP(uint8_t mA);  // Over Current Protection control
 
     uint32_t random();
+    // raw wideband RSSI noise, each byte packs the LSB of 8 reads taken
+    // RSSI_SAMPLE_US (1 ms) apart, so 8 ms per byte; samples from sleep,
+    // standby or continuous RX only and returns false while transmitting, in
+    // a single receive or in CAD
+    bool randomNoise(uint8_t* buffer, size_t size);
 
     void setSPIFrequency(uint32_t frequency);
 
     uint32_t timeOnAir(uint16_t pkt_len);
     bool     channelActive(int16_t rssi_threshold, uint32_t max_sense_time);
 
+    // queue dispatched on the driver thread, for layers built on top
+    EventQueue* eventQueue();
+    // true when called from the driver thread, where waiting on an event
+    // posted to eventQueue() would deadlock
+    bool onDriverThread();
+
+    // records every received frame into capture, nullptr to stop
+    void setCapture(LoRaCapture* capture);
+    // runs a recorded frame through the onReceive path on the driver thread
+    // and waits for it, read() and the packet metrics serve the recorded
+    // values for the callback's duration; false if the queue is full
+    bool injectPacket(const LoRaTraceRecord& record, const uint8_t* payload);
+
    private:
     void explicitHeaderMode();
     void implicitHeaderMode();
 
+    void dio0Isr();
     void handleDio0Rise();
+    void handleDio1Rise();
+    void completeRxSingle(uint8_t irqFlags);
+    void capturePacket(uint8_t irqFlags);
+    void handleInject(const LoRaTraceRecord* record, const uint8_t* payload,
+                      Semaphore* done);
     bool isTransmitting();
 
     uint32_t getSpreadingFactor();
@@ -112,8 +160,9 @@ class LoRaPort {
     DigitalOut               _ss;
     DigitalOut               _reset;
     InterruptIn              _dio0;
+    InterruptIn*             _dio1;
     long                     _frequency;
-    float                    _bandwidth;
+    float                    _bandwidth = 125E3;
     uint8_t                  _datarate = 7;
     uint8_t                  _coderate = 5;
     uint16_t                 _preamble_len = 8;
@@ -122,6 +171,13 @@ class LoRaPort {
     bool                     _implicitHeaderMode;
     Callback<void(uint16_t)> _onReceive;
     Callback<void()>         _onTxDone;
+    Callback<void(int16_t)>  _onRxSingle;
+    int                      _rxTimeoutEvent = 0;
+    ALIAS_LORAWAN_CLOCK      _clock;
+    volatile us_timestamp_t  _dio0Timestamp = 0;
+    LoRaCapture*             _capture = nullptr;
+    const LoRaTraceRecord*   _replayRecord = nullptr;
+    const uint8_t*           _replayPayload = nullptr;
 
     Thread     lora_thread;
     EventQueue queue;
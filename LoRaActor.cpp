@@ -0,0 +1,296 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaActor.h>
+
+// commands
+#define OP_TRANSMIT         0
+#define OP_RECEIVE          1
+#define OP_IDLE             2
+#define OP_SLEEP            3
+#define OP_SET_TX_POWER     4
+#define OP_SET_FREQUENCY    5
+#define OP_SET_SF           6
+#define OP_SET_BANDWIDTH    7
+#define OP_SET_CODING_RATE  8
+#define OP_SET_PREAMBLE_LEN 9
+#define OP_SET_SYNC_WORD    10
+#define OP_ENABLE_CRC       11
+#define OP_RANDOM           12
+
+#define QUEUE_MASK (LORA_ACTOR_QUEUE_SIZE - 1)
+
+// interval between attempts to post a drain while the event queue is full
+#define DRAIN_RETRY_US 1000
+
+LoRaFuture::LoRaFuture() : _done(0, 1), _ready(false), _result(0) {
+}
+
+bool LoRaFuture::ready() {
+    return _ready;
+}
+
+int32_t LoRaFuture::wait() {
+    if (!_ready) {
+        _done.acquire();
+    }
+
+    return _result;
+}
+
+void LoRaFuture::reset() {
+    // swallow a completion that was never waited for
+    _done.try_acquire();
+    _ready = false;
+}
+
+void LoRaFuture::complete(int32_t result) {
+    _result = result;
+    _ready = true;
+    _done.release();
+}
+
+LoRaActor::LoRaActor(LoRaPort* lora)
+    : _lora(lora),
+      _queue(lora->eventQueue()),
+      _enqueuePos(0),
+      _dequeuePos(0),
+      _drainScheduled(0),
+      _overruns(0) {
+    for (uint32_t i = 0; i < LORA_ACTOR_QUEUE_SIZE; i++) {
+        _cells[i].sequence = i;
+    }
+}
+
+bool LoRaActor::transmit(const uint8_t* buffer, uint8_t size,
+                         LoRaFuture* future, bool implicitHeader) {
+    if (size > LORA_ACTOR_MAX_PAYLOAD) {
+        return false;
+    }
+
+    Cell* cell = claim();
+    if (!cell) {
+        return false;
+    }
+
+    // the payload is copied straight into the claimed cell
+    cell->command.op = OP_TRANSMIT;
+    cell->command.size = size;
+    cell->command.flag = implicitHeader;
+    memcpy(cell->command.data, buffer, size);
+    publish(cell, future);
+
+    return true;
+}
+
+bool LoRaActor::receive(uint8_t size, LoRaFuture* future) {
+    return post(OP_RECEIVE, size, false, future);
+}
+
+bool LoRaActor::idle(LoRaFuture* future) {
+    return post(OP_IDLE, 0, false, future);
+}
+
+bool LoRaActor::sleep(LoRaFuture* future) {
+    return post(OP_SLEEP, 0, false, future);
+}
+
+bool LoRaActor::setTxPower(uint8_t level, PinName outputPin,
+                           LoRaFuture* future) {
+    Cell* cell = claim();
+    if (!cell) {
+        return false;
+    }
+
+    cell->command.op = OP_SET_TX_POWER;
+    cell->command.size = level;
+    cell->command.value = outputPin;
+    publish(cell, future);
+
+    return true;
+}
+
+bool LoRaActor::setFrequency(long frequency, LoRaFuture* future) {
+    return post(OP_SET_FREQUENCY, frequency, false, future);
+}
+
+bool LoRaActor::setSpreadingFactor(uint32_t sf, LoRaFuture* future) {
+    return post(OP_SET_SF, sf, false, future);
+}
+
+bool LoRaActor::setSignalBandwidth(uint32_t sbw, LoRaFuture* future) {
+    return post(OP_SET_BANDWIDTH, sbw, false, future);
+}
+
+bool LoRaActor::setCodingRate4(uint8_t denominator, LoRaFuture* future) {
+    return post(OP_SET_CODING_RATE, denominator, false, future);
+}
+
+bool LoRaActor::setPreambleLength(uint16_t length, LoRaFuture* future) {
+    return post(OP_SET_PREAMBLE_LEN, length, false, future);
+}
+
+bool LoRaActor::setSyncWord(uint8_t sw, LoRaFuture* future) {
+    return post(OP_SET_SYNC_WORD, sw, false, future);
+}
+
+bool LoRaActor::enableCrc(bool enable, LoRaFuture* future) {
+    return post(OP_ENABLE_CRC, 0, enable, future);
+}
+
+bool LoRaActor::random(LoRaFuture* future) {
+    return post(OP_RANDOM, 0, false, future);
+}
+
+uint32_t LoRaActor::overruns() {
+    return _overruns;
+}
+
+LoRaActor::Cell* LoRaActor::claim() {
+    // bounded MPMC ring (D. Vyukov) used with a single consumer: a cell whose
+    // sequence equals the enqueue position is free for that position
+    uint32_t pos = core_util_atomic_load_u32(&_enqueuePos);
+
+    while (true) {
+        Cell*    cell = &_cells[pos & QUEUE_MASK];
+        uint32_t seq = core_util_atomic_load_u32(&cell->sequence);
+        int32_t  dif = (int32_t)(seq - pos);
+
+        if (dif == 0) {
+            if (core_util_atomic_cas_u32(&_enqueuePos, &pos, pos + 1)) {
+                return cell;
+            }
+            // pos now holds the current enqueue position, retry
+        } else if (dif < 0) {
+            core_util_atomic_incr_u32(&_overruns, 1);
+            return NULL;
+        } else {
+            pos = core_util_atomic_load_u32(&_enqueuePos);
+        }
+    }
+}
+
+void LoRaActor::publish(Cell* cell, LoRaFuture* future) {
+    if (future) {
+        future->reset();
+    }
+    cell->command.future = future;
+
+    // hand the cell to the consumer
+    core_util_atomic_store_u32(&cell->sequence, cell->sequence + 1);
+
+    scheduleDrain();
+}
+
+bool LoRaActor::post(uint8_t op, int32_t value, bool flag,
+                     LoRaFuture* future) {
+    Cell* cell = claim();
+    if (!cell) {
+        return false;
+    }
+
+    cell->command.op = op;
+    cell->command.value = value;
+    cell->command.flag = flag;
+    publish(cell, future);
+
+    return true;
+}
+
+void LoRaActor::scheduleDrain() {
+    uint8_t expected = 0;
+    if (core_util_atomic_cas_u8(&_drainScheduled, &expected, 1)) {
+        postDrain();
+    }
+}
+
+void LoRaActor::postDrain() {
+    // only the owner of _drainScheduled gets here, so a single retry timer
+    // is ever armed
+    if (!_queue->call(this, &LoRaActor::drain)) {
+        // event queue full; the drain stays scheduled and is retried, as
+        // nothing else may publish again to wake up commands in the ring
+        _retryTimer.attach_us(callback(this, &LoRaActor::postDrain),
+                              DRAIN_RETRY_US);
+    }
+}
+
+void LoRaActor::drain() {
+    // cleared before looking at the ring so a concurrent publish is either
+    // seen below or schedules another drain
+    core_util_atomic_store_u8(&_drainScheduled, 0);
+
+    for (uint8_t n = 0; n < LORA_ACTOR_BATCH; n++) {
+        Cell*    cell = &_cells[_dequeuePos & QUEUE_MASK];
+        uint32_t seq = core_util_atomic_load_u32(&cell->sequence);
+        if (seq != _dequeuePos + 1) {
+            return;
+        }
+
+        LoRaFuture* future = cell->command.future;
+        int32_t     result = execute(cell->command);
+
+        // release the cell for the producer one lap ahead
+        core_util_atomic_store_u32(&cell->sequence,
+                                   _dequeuePos + LORA_ACTOR_QUEUE_SIZE);
+        _dequeuePos++;
+
+        if (future) {
+            future->complete(result);
+        }
+    }
+
+    // batch exhausted, let other driver events run before continuing
+    scheduleDrain();
+}
+
+int32_t LoRaActor::execute(const Command& command) {
+    switch (command.op) {
+        case OP_TRANSMIT: {
+            if (!_lora->beginPacket(command.flag)) {
+                return 0;
+            }
+            int32_t written = _lora->write(command.data, command.size);
+            _lora->endPacket();
+            return written;
+        }
+        case OP_RECEIVE:
+            _lora->receive(command.value);
+            break;
+        case OP_IDLE:
+            _lora->lora_idle();
+            break;
+        case OP_SLEEP:
+            _lora->lora_sleep();
+            break;
+        case OP_SET_TX_POWER:
+            _lora->setTxPower(command.size, (PinName)command.value);
+            break;
+        case OP_SET_FREQUENCY:
+            _lora->setFrequency(command.value);
+            break;
+        case OP_SET_SF:
+            _lora->setSpreadingFactor(command.value);
+            break;
+        case OP_SET_BANDWIDTH:
+            _lora->setSignalBandwidth(command.value);
+            break;
+        case OP_SET_CODING_RATE:
+            _lora->setCodingRate4(command.value);
+            break;
+        case OP_SET_PREAMBLE_LEN:
+            _lora->setPreambleLength(command.value);
+            break;
+        case OP_SET_SYNC_WORD:
+            _lora->setSyncWord(command.value);
+            break;
+        case OP_ENABLE_CRC:
+            _lora->enableCrc(command.flag);
+            break;
+        case OP_RANDOM:
+            return _lora->random();
+    }
+
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Actor-style front end for LoRaPort.
+//
+// Calls are packed into fixed-size commands and pushed onto a bounded,
+// lock-free multi-producer/single-consumer ring that is drained in batches on
+// the driver thread, the same thread that runs the DIO handlers. Any number
+// of application threads can use it concurrently; the radio is only ever
+// touched from the driver thread. Once an actor is in use the port's own
+// methods must not be called from other threads.
+
+#ifndef LORA_ACTOR_H
+#define LORA_ACTOR_H
+
+#include "LoRa.h"
+#include "mbed_critical.h"
+
+// commands in the ring, power of two
+#ifndef LORA_ACTOR_QUEUE_SIZE
+    #define LORA_ACTOR_QUEUE_SIZE 16
+#endif
+
+// largest frame accepted by transmit(), copied into the command
+#ifndef LORA_ACTOR_MAX_PAYLOAD
+    #define LORA_ACTOR_MAX_PAYLOAD 64
+#endif
+
+// commands executed per dispatch before yielding to other events
+#ifndef LORA_ACTOR_BATCH
+    #define LORA_ACTOR_BATCH 8
+#endif
+
+#if (LORA_ACTOR_QUEUE_SIZE & (LORA_ACTOR_QUEUE_SIZE - 1))
+    #error "LORA_ACTOR_QUEUE_SIZE must be a power of two"
+#endif
+
+// Result of a posted command, may be reused once it has completed.
+class LoRaFuture {
+   public:
+    LoRaFuture();
+
+    bool    ready();
+    int32_t wait();
+
+   private:
+    friend class LoRaActor;
+
+    void reset();
+    void complete(int32_t result);
+
+   private:
+    Semaphore        _done;
+    volatile bool    _ready;
+    volatile int32_t _result;
+};
+
+class LoRaActor {
+   public:
+    LoRaActor(LoRaPort* lora);
+
+    // all return false if the command ring is full; the future, if given,
+    // completes with the port method's return value (0 for void methods)
+    bool transmit(const uint8_t* buffer, uint8_t size,
+                  LoRaFuture* future = NULL, bool implicitHeader = false);
+    bool receive(uint8_t size = 0, LoRaFuture* future = NULL);
+    bool idle(LoRaFuture* future = NULL);
+    bool sleep(LoRaFuture* future = NULL);
+
+    bool setTxPower(uint8_t level,
+                    PinName outputPin = (PinName)PA_OUTPUT_PA_BOOST_PIN,
+                    LoRaFuture* future = NULL);
+    bool setFrequency(long frequency, LoRaFuture* future = NULL);
+    bool setSpreadingFactor(uint32_t sf, LoRaFuture* future = NULL);
+    bool setSignalBandwidth(uint32_t sbw, LoRaFuture* future = NULL);
+    bool setCodingRate4(uint8_t denominator, LoRaFuture* future = NULL);
+    bool setPreambleLength(uint16_t length, LoRaFuture* future = NULL);
+    bool setSyncWord(uint8_t sw, LoRaFuture* future = NULL);
+    bool enableCrc(bool enable, LoRaFuture* future = NULL);
+
+    bool random(LoRaFuture* future);
+
+    // commands rejected because the ring was full
+    uint32_t overruns();
+
+   private:
+    struct Command {
+        uint8_t     op;
+        uint8_t     size;
+        bool        flag;
+        int32_t     value;
+        LoRaFuture* future;
+        uint8_t     data[LORA_ACTOR_MAX_PAYLOAD];
+    };
+
+    struct Cell {
+        volatile uint32_t sequence;
+        Command           command;
+    };
+
+    Cell* claim();
+    void  publish(Cell* cell, LoRaFuture* future);
+    bool  post(uint8_t op, int32_t value, bool flag, LoRaFuture* future);
+
+    void    scheduleDrain();
+    void    postDrain();
+    void    drain();
+    int32_t execute(const Command& command);
+
+   private:
+    LoRaPort*   _lora;
+    EventQueue* _queue;
+
+    ALIAS_LORAWAN_TIMER _retryTimer;
+
+    Cell              _cells[LORA_ACTOR_QUEUE_SIZE];
+    volatile uint32_t _enqueuePos;
+    uint32_t          _dequeuePos;
+    volatile uint8_t  _drainScheduled;
+    volatile uint32_t _overruns;
+};
+
+#endif
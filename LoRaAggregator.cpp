@@ -0,0 +1,250 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaAggregator.h>
+
+#define NO_DEADLINE UINT64_MAX
+
+LoRaAggregator::LoRaAggregator(LoRaPort* lora)
+    : _lora(lora),
+      _queue(lora->eventQueue()),
+      _maxFrame(LORA_AGGREGATOR_MAX_FRAME),
+      _maxAirtime(0),
+      _fill(0),
+      _sendIndex(0),
+      _sending(false),
+      _deadline(NO_DEADLINE),
+      _flushAt(NO_DEADLINE),
+      _deadlineEvent(0),
+      _deadlineGeneration(0),
+      _onMessage(NULL) {
+    _length[0] = 0;
+    _length[1] = 0;
+}
+
+LoRaAggregator::~LoRaAggregator() {
+    if (_deadlineEvent) {
+        _queue->cancel(_deadlineEvent);
+    }
+    if (_onMessage) {
+        _lora->onReceive(nullptr);
+    }
+}
+
+void LoRaAggregator::setMaxFrameLength(uint8_t length) {
+    if (length < 2) {
+        length = 2;
+    }
+#if (LORA_AGGREGATOR_MAX_FRAME < 255)
+    if (length > LORA_AGGREGATOR_MAX_FRAME) {
+        length = LORA_AGGREGATOR_MAX_FRAME;
+    }
+#endif
+    _maxFrame = length;
+}
+
+void LoRaAggregator::setMaxAirtime(uint32_t ms) {
+    _maxAirtime = ms;
+}
+
+uint8_t LoRaAggregator::post(const uint8_t* buffer, uint8_t size,
+                             uint32_t deadline_ms) {
+    if (size == 0 || size + 1 > _maxFrame) {
+        return 0;
+    }
+
+    _mutex.lock();
+    if (!fits(size)) {
+        if (_sending || !swapFrames()) {
+            _mutex.unlock();
+            return 0;
+        }
+    }
+
+    uint8_t* frame = _frames[_fill];
+    frame[_length[_fill]] = size;
+    memcpy(&frame[_length[_fill] + 1], buffer, size);
+    _length[_fill] += size + 1;
+
+    uint64_t at = Kernel::get_ms_count() + deadline_ms;
+    if (at < _deadline) {
+        _deadline = at;
+    }
+
+    bool sent = false;
+    if (deadline_ms == 0 && !_sending) {
+        sent = swapFrames();
+    }
+    if (!sent) {
+        // the flush time moves as the frame grows, even for a later deadline
+        scheduleDeadline();
+    }
+    _mutex.unlock();
+
+    return 1;
+}
+
+void LoRaAggregator::flush() {
+    _mutex.lock();
+    swapFrames();
+    _mutex.unlock();
+}
+
+void LoRaAggregator::onMessage(Callback<void(const uint8_t*, uint8_t)> cb) {
+    _onMessage = cb;
+
+    if (cb) {
+        _lora->onReceive(callback(this, &LoRaAggregator::handleReceive));
+        _lora->receive();
+    } else {
+        _lora->onReceive(nullptr);
+    }
+}
+
+uint8_t LoRaAggregator::split(const uint8_t* frame, uint8_t length,
+                              Callback<void(const uint8_t*, uint8_t)> cb) {
+    uint8_t count = 0;
+    uint8_t offset = 0;
+
+    while (offset < length) {
+        uint8_t size = frame[offset];
+        if (size == 0 || size > length - offset - 1) {
+            // truncated or corrupt record, nothing after it can be trusted
+            break;
+        }
+
+        if (cb) {
+            cb(&frame[offset + 1], size);
+        }
+        offset += size + 1;
+        count++;
+    }
+
+    return count;
+}
+
+bool LoRaAggregator::fits(uint8_t size) {
+    uint16_t length = _length[_fill] + size + 1;
+
+    if (length > _maxFrame) {
+        return false;
+    }
+
+    // a lone message is always sent, even if it alone exceeds the limit
+    if (_maxAirtime && _length[_fill] > 0 &&
+        _lora->timeOnAir(length) > _maxAirtime) {
+        return false;
+    }
+
+    return true;
+}
+
+bool LoRaAggregator::swapFrames() {
+    if (_length[_fill] == 0 || _sending) {
+        // a busy send buffer is followed up by transmit() once it is free
+        return false;
+    }
+
+    _sending = true;
+    _sendIndex = _fill;
+    _fill ^= 1;
+
+    if (!_queue->call(this, &LoRaAggregator::transmit)) {
+        // queue full, the frame stays in the fill buffer
+        _fill = _sendIndex;
+        _sending = false;
+        return false;
+    }
+
+    _length[_fill] = 0;
+    if (_deadlineEvent) {
+        _queue->cancel(_deadlineEvent);
+        _deadlineEvent = 0;
+        _deadlineGeneration++;
+    }
+    _deadline = NO_DEADLINE;
+    _flushAt = NO_DEADLINE;
+
+    return true;
+}
+
+void LoRaAggregator::scheduleDeadline() {
+    if (_deadline == NO_DEADLINE) {
+        return;
+    }
+
+    // leave room for this frame and any frame still ahead of it to go out
+    uint64_t lead = _lora->timeOnAir(_length[_fill]);
+    lead += LORA_AGGREGATOR_MARGIN_MS;
+    if (_sending) {
+        lead += _lora->timeOnAir(_length[_sendIndex]);
+    }
+
+    uint64_t now = Kernel::get_ms_count();
+    uint64_t at = _deadline > now + lead ? _deadline - lead : now;
+
+    if (_deadlineEvent) {
+        if (at >= _flushAt) {
+            return;
+        }
+        _queue->cancel(_deadlineEvent);
+    }
+
+    // an event already dispatched and waiting on the mutex is not
+    // cancelled, the generation tells it apart
+    _flushAt = at;
+    _deadlineGeneration++;
+    _deadlineEvent =
+        _queue->call_in((int)(at - now), this, &LoRaAggregator::handleDeadline,
+                        _deadlineGeneration);
+    if (!_deadlineEvent && !swapFrames()) {
+        // no timer behind it, so transmit() treats the fill buffer as due
+        _flushAt = now;
+    }
+}
+
+void LoRaAggregator::handleDeadline(uint32_t generation) {
+    _mutex.lock();
+    if (generation != _deadlineGeneration) {
+        // replaced while waiting for the mutex
+        _mutex.unlock();
+        return;
+    }
+
+    _deadlineEvent = 0;
+    swapFrames();
+    _mutex.unlock();
+}
+
+void LoRaAggregator::transmit() {
+    _lora->beginPacket();
+    _lora->write(_frames[_sendIndex], _length[_sendIndex]);
+    _lora->endPacket();
+
+    if (_onMessage) {
+        _lora->receive();
+    }
+
+    _mutex.lock();
+    _length[_sendIndex] = 0;
+    _sending = false;
+    if (_length[_fill] > 0 &&
+        (_deadlineEvent == 0 || Kernel::get_ms_count() >= _flushAt)) {
+        // the fill buffer became due while this frame was on air
+        swapFrames();
+    }
+    _mutex.unlock();
+}
+
+void LoRaAggregator::handleReceive(uint16_t length) {
+    if (length > LORA_AGGREGATOR_MAX_FRAME) {
+        length = LORA_AGGREGATOR_MAX_FRAME;
+    }
+
+    for (uint16_t i = 0; i < length; i++) {
+        _rxFrame[i] = _lora->read();
+    }
+
+    split(_rxFrame, length, _onMessage);
+}
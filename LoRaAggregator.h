@@ -0,0 +1,89 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Coalesces small messages into a single LoRa frame so the preamble and
+// header are paid once per frame rather than once per message.
+//
+// Each message is stored as [length][payload]. A frame is sent when the next
+// message would not fit the size or airtime limit, or early enough for it to
+// be on air by the earliest deadline of the messages it holds. Two frame
+// buffers are used so messages can be posted while the previous frame is on
+// air.
+
+#ifndef LORA_AGGREGATOR_H
+#define LORA_AGGREGATOR_H
+
+#include "LoRa.h"
+
+#ifndef LORA_AGGREGATOR_MAX_FRAME
+    #define LORA_AGGREGATOR_MAX_FRAME 255
+#endif
+
+#if (LORA_AGGREGATOR_MAX_FRAME > 255)
+    #error "LORA_AGGREGATOR_MAX_FRAME must fit a LoRa frame of 255 bytes"
+#endif
+
+// slack for event dispatch and radio setup ahead of a deadline
+#ifndef LORA_AGGREGATOR_MARGIN_MS
+    #define LORA_AGGREGATOR_MARGIN_MS 10
+#endif
+
+class LoRaAggregator {
+   public:
+    LoRaAggregator(LoRaPort* lora);
+    ~LoRaAggregator();
+
+    void setMaxFrameLength(uint8_t length);
+    // limit on timeOnAir() of a frame in ms, 0 disables
+    void setMaxAirtime(uint32_t ms);
+
+    // queues a message whose frame should have left the air within
+    // deadline_ms; the flush is brought forward by the airtime of the frame
+    // and of any frame still on air ahead of it, so a deadline shorter than
+    // those is best effort. Returns 0 if it is too large or both frame
+    // buffers are busy
+    uint8_t post(const uint8_t* buffer, uint8_t size, uint32_t deadline_ms);
+    void    flush();
+
+    // takes over the port's receive callback and delivers each message of
+    // a received frame, pointing into the receive buffer
+    void onMessage(Callback<void(const uint8_t*, uint8_t)> cb);
+
+    // walks the messages of an aggregated frame without copying them,
+    // returns the number of complete messages found
+    static uint8_t split(const uint8_t* frame, uint8_t length,
+                         Callback<void(const uint8_t*, uint8_t)> cb);
+
+   private:
+    bool fits(uint8_t size);
+    bool swapFrames();
+    void scheduleDeadline();
+
+    void handleDeadline(uint32_t generation);
+    void transmit();
+    void handleReceive(uint16_t length);
+
+   private:
+    LoRaPort*   _lora;
+    EventQueue* _queue;
+    Mutex       _mutex;
+
+    uint8_t  _maxFrame;
+    uint32_t _maxAirtime;
+
+    uint8_t  _frames[2][LORA_AGGREGATOR_MAX_FRAME];
+    uint8_t  _length[2];
+    uint8_t  _fill;
+    uint8_t  _sendIndex;
+    bool     _sending;
+    uint64_t _deadline;  // earliest deadline in the fill buffer
+    uint64_t _flushAt;
+    int      _deadlineEvent;
+    uint32_t _deadlineGeneration;  // bumped whenever the event is replaced
+
+    uint8_t                                 _rxFrame[LORA_AGGREGATOR_MAX_FRAME];
+    Callback<void(const uint8_t*, uint8_t)> _onMessage;
+};
+
+#endif
@@ -0,0 +1,55 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaCapture.h>
+
+LoRaCapture::LoRaCapture() : _ring(_storage, sizeof(_storage)) {
+}
+
+bool LoRaCapture::append(const LoRaTraceRecord& record,
+                         const uint8_t* payload) {
+    _mutex.lock();
+    bool stored = _ring.append(record, payload);
+    _mutex.unlock();
+
+    return stored;
+}
+
+size_t LoRaCapture::drain(uint8_t* buffer, size_t size) {
+    _mutex.lock();
+    size_t copied = _ring.drain(buffer, size);
+    _mutex.unlock();
+
+    return copied;
+}
+
+size_t LoRaCapture::used() {
+    _mutex.lock();
+    size_t used = _ring.used();
+    _mutex.unlock();
+
+    return used;
+}
+
+uint32_t LoRaCapture::dropped() {
+    return _ring.dropped();
+}
+
+void LoRaCapture::clear() {
+    _mutex.lock();
+    _ring.clear();
+    _mutex.unlock();
+}
+
+LoRaReplaySink::LoRaReplaySink(LoRaPort* lora) : _lora(lora) {
+}
+
+void LoRaReplaySink::inject(const LoRaTraceRecord& record,
+                            const uint8_t*         payload) {
+    _lora->injectPacket(record, payload);
+}
+
+void LoRaReplaySink::delay(uint32_t ms) {
+    ThisThread::sleep_for(ms);
+}
@@ -0,0 +1,52 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Optional capture stage for the RX path. Once attached with
+// LoRaPort::setCapture() every frame seen by the DIO0 handler is appended to
+// a LoRaTraceRing together with its IRQ flags, link metrics and the modem
+// configuration, ready to be drained to storage.
+
+#ifndef LORA_CAPTURE_H
+#define LORA_CAPTURE_H
+
+#include "LoRa.h"
+#include "LoRaTrace.h"
+
+#ifndef LORA_CAPTURE_SIZE
+    #define LORA_CAPTURE_SIZE 4096
+#endif
+
+class LoRaCapture {
+   public:
+    LoRaCapture();
+
+    bool append(const LoRaTraceRecord& record, const uint8_t* payload);
+    // copies out whole records, returns the bytes written
+    size_t drain(uint8_t* buffer, size_t size);
+
+    size_t   used();
+    uint32_t dropped();
+    void     clear();
+
+   private:
+    Mutex         _mutex;
+    uint8_t       _storage[LORA_CAPTURE_SIZE];
+    LoRaTraceRing _ring;
+};
+
+// LoRaTraceReplayer sink injecting records into a port's onReceive path.
+// Each record is delivered on the driver thread and inject() returns once its
+// callback has run. The radio should be idle while replaying.
+class LoRaReplaySink {
+   public:
+    LoRaReplaySink(LoRaPort* lora);
+
+    void inject(const LoRaTraceRecord& record, const uint8_t* payload);
+    void delay(uint32_t ms);
+
+   private:
+    LoRaPort* _lora;
+};
+
+#endif
@@ -0,0 +1,305 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaEntropy.h>
+
+// SP 800-90B 4.4 cutoffs for an assumed 0.5 bit/sample, alpha = 2^-20
+#define RCT_CUTOFF  41
+#define APT_WINDOW  1024
+#define APT_CUTOFF  793
+#define RAW_CHUNK   16
+#define KEY_BYTES   32
+#define BLOCK_BYTES 64
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    a += b;                      \
+    d ^= a;                      \
+    d = ROTL32(d, 16);           \
+    c += d;                      \
+    b ^= c;                      \
+    b = ROTL32(b, 12);           \
+    a += b;                      \
+    d ^= a;                      \
+    d = ROTL32(d, 8);            \
+    c += d;                      \
+    b ^= c;                      \
+    b = ROTL32(b, 7);
+
+#if (LORA_ENTROPY_BUFFER % BLOCK_BYTES) || (LORA_ENTROPY_BUFFER <= KEY_BYTES)
+    #error "LORA_ENTROPY_BUFFER must be a multiple of 64 bytes"
+#endif
+
+#if (LORA_ENTROPY_POOL_BYTES % KEY_BYTES)
+    #error "LORA_ENTROPY_POOL_BYTES must be a multiple of 32 bytes"
+#endif
+
+static uint32_t loadU32(const uint8_t* in) {
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+           ((uint32_t)in[3] << 24);
+}
+
+LoRaEntropy::LoRaEntropy(LoRaPort* lora)
+    : _lora(lora),
+      _available(0),
+      _sinceSeed(0),
+      _seeded(false),
+      _reseedPending(false),
+      _failures(0) {
+    memset(_key, 0, sizeof(_key));
+    resetHealthTests();
+}
+
+LoRaEntropy::~LoRaEntropy() {
+    memset(_key, 0, sizeof(_key));
+    memset(_buffer, 0, sizeof(_buffer));
+}
+
+bool LoRaEntropy::seed() {
+    if (_lora->onDriverThread()) {
+        // e.g. from an onReceive handler, waiting on the queue would deadlock
+        return reseed();
+    }
+
+    bool      result = false;
+    Semaphore done(0, 1);
+
+    if (!_lora->eventQueue()->call(this, &LoRaEntropy::handleSeed, &result,
+                                   &done)) {
+        return false;
+    }
+    done.acquire();
+
+    return result;
+}
+
+bool LoRaEntropy::reseed() {
+    uint8_t pool[LORA_ENTROPY_POOL_BYTES];
+
+    if (!collect(pool)) {
+        return false;
+    }
+
+    _mutex.lock();
+    mix(pool);
+    _seeded = true;
+    _sinceSeed = 0;
+    _mutex.unlock();
+
+    memset(pool, 0, sizeof(pool));
+    return true;
+}
+
+bool LoRaEntropy::randomBytes(uint8_t* buffer, size_t size) {
+    _mutex.lock();
+    if (!_seeded) {
+        _mutex.unlock();
+        return false;
+    }
+
+    while (size > 0) {
+        if (_available == 0) {
+            refill();
+        }
+
+        size_t   n = size < _available ? size : _available;
+        uint8_t* out = &_buffer[LORA_ENTROPY_BUFFER - _available];
+
+        memcpy(buffer, out, n);
+        // served bytes are not kept around
+        memset(out, 0, n);
+
+        _available -= n;
+        buffer += n;
+        size -= n;
+        _sinceSeed += n;
+    }
+
+    bool due = _sinceSeed >= LORA_ENTROPY_RESEED_BYTES && !_reseedPending;
+    if (due) {
+        _reseedPending = true;
+    }
+    _mutex.unlock();
+
+    // sampling switches the radio to RX, keep it on the driver thread
+    if (due && !_lora->eventQueue()->call(this, &LoRaEntropy::handleReseed)) {
+        _reseedPending = false;
+    }
+
+    return true;
+}
+
+bool LoRaEntropy::random(uint32_t* value) {
+    uint8_t bytes[4];
+
+    if (!randomBytes(bytes, sizeof(bytes))) {
+        return false;
+    }
+
+    *value = loadU32(bytes);
+    return true;
+}
+
+uint32_t LoRaEntropy::healthFailures() {
+    return _failures;
+}
+
+bool LoRaEntropy::collect(uint8_t* pool) {
+    uint8_t raw[RAW_CHUNK];
+    size_t  filled = 0;
+    uint8_t bits = 0;
+    uint8_t count = 0;
+
+    for (size_t read = 0; read < LORA_ENTROPY_MAX_RAW_BYTES;
+         read += RAW_CHUNK) {
+        if (!_lora->randomNoise(raw, sizeof(raw))) {
+            // radio busy, not a health failure
+            return false;
+        }
+
+        for (uint8_t i = 0; i < RAW_CHUNK; i++) {
+            for (uint8_t shift = 8; shift > 0; shift -= 2) {
+                uint8_t first = (raw[i] >> (shift - 1)) & 0x01;
+                uint8_t second = (raw[i] >> (shift - 2)) & 0x01;
+
+                if (!healthTest(first) || !healthTest(second)) {
+                    _failures++;
+                    resetHealthTests();
+                    return false;
+                }
+
+                // von Neumann: 01 -> 0, 10 -> 1, equal pairs are dropped
+                if (first == second) {
+                    continue;
+                }
+
+                bits = (bits << 1) | first;
+                if (++count == 8) {
+                    pool[filled++] = bits;
+                    count = 0;
+                    if (filled == LORA_ENTROPY_POOL_BYTES) {
+                        return true;
+                    }
+                }
+            }
+        }
+    }
+
+    return false;
+}
+
+bool LoRaEntropy::healthTest(uint8_t bit) {
+    // repetition count test
+    if (bit == _rctLast) {
+        if (++_rctCount >= RCT_CUTOFF) {
+            return false;
+        }
+    } else {
+        _rctLast = bit;
+        _rctCount = 1;
+    }
+
+    // adaptive proportion test
+    if (_aptIndex == 0) {
+        _aptFirst = bit;
+        _aptCount = 1;
+    } else if (bit == _aptFirst) {
+        if (++_aptCount >= APT_CUTOFF) {
+            return false;
+        }
+    }
+    if (++_aptIndex == APT_WINDOW) {
+        _aptIndex = 0;
+    }
+
+    return true;
+}
+
+void LoRaEntropy::resetHealthTests() {
+    _rctLast = 0xff;
+    _rctCount = 0;
+    _aptFirst = 0;
+    _aptCount = 0;
+    _aptIndex = 0;
+}
+
+void LoRaEntropy::mix(const uint8_t* pool) {
+    uint8_t block[BLOCK_BYTES];
+
+    for (size_t offset = 0; offset < LORA_ENTROPY_POOL_BYTES;
+         offset += KEY_BYTES) {
+        for (uint8_t i = 0; i < 8; i++) {
+            _key[i] ^= loadU32(&pool[offset + i * 4]);
+        }
+
+        // compress through the cipher so no pool bits appear in the key
+        chachaBlock(_key, 0, block);
+        for (uint8_t i = 0; i < 8; i++) {
+            _key[i] = loadU32(&block[i * 4]);
+        }
+    }
+
+    // anything buffered came from the old key
+    memset(block, 0, sizeof(block));
+    memset(_buffer, 0, sizeof(_buffer));
+    _available = 0;
+}
+
+void LoRaEntropy::refill() {
+    for (uint32_t i = 0; i < LORA_ENTROPY_BUFFER / BLOCK_BYTES; i++) {
+        chachaBlock(_key, i, &_buffer[i * BLOCK_BYTES]);
+    }
+
+    // fast key erasure: the first 32 bytes become the next key
+    for (uint8_t i = 0; i < 8; i++) {
+        _key[i] = loadU32(&_buffer[i * 4]);
+    }
+    memset(_buffer, 0, KEY_BYTES);
+
+    _available = LORA_ENTROPY_BUFFER - KEY_BYTES;
+}
+
+void LoRaEntropy::handleSeed(bool* result, Semaphore* done) {
+    *result = reseed();
+    done->release();
+}
+
+void LoRaEntropy::handleReseed() {
+    // a busy radio just leaves the reseed to the next request
+    reseed();
+    _reseedPending = false;
+}
+
+void LoRaEntropy::chachaBlock(const uint32_t key[8], uint32_t counter,
+                              uint8_t out[64]) {
+    uint32_t state[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                          key[0],     key[1],     key[2],     key[3],
+                          key[4],     key[5],     key[6],     key[7],
+                          counter,    0,          0,          0};
+    uint32_t x[16];
+
+    memcpy(x, state, sizeof(x));
+
+    for (uint8_t i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12])
+        QUARTERROUND(x[1], x[5], x[9], x[13])
+        QUARTERROUND(x[2], x[6], x[10], x[14])
+        QUARTERROUND(x[3], x[7], x[11], x[15])
+        QUARTERROUND(x[0], x[5], x[10], x[15])
+        QUARTERROUND(x[1], x[6], x[11], x[12])
+        QUARTERROUND(x[2], x[7], x[8], x[13])
+        QUARTERROUND(x[3], x[4], x[9], x[14])
+    }
+
+    for (uint8_t i = 0; i < 16; i++) {
+        uint32_t v = x[i] + state[i];
+        out[i * 4 + 0] = (uint8_t)(v >> 0);
+        out[i * 4 + 1] = (uint8_t)(v >> 8);
+        out[i * 4 + 2] = (uint8_t)(v >> 16);
+        out[i * 4 + 3] = (uint8_t)(v >> 24);
+    }
+
+    memset(x, 0, sizeof(x));
+}
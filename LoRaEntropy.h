@@ -0,0 +1,92 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Entropy pool fed from wideband RSSI noise.
+//
+// Raw LSB samples from LoRaPort::randomNoise() go through the SP 800-90B
+// repetition count and adaptive proportion health tests, are de-biased with
+// a von Neumann extractor and folded into the key of a ChaCha20 generator.
+// randomBytes() is then served from memory; the generator rekeys itself after
+// every refill and reseeds after LORA_ENTROPY_RESEED_BYTES of output. The
+// radio is only ever sampled on the driver thread.
+//
+// Noise is sampled at one bit per ms and the extractor keeps about a quarter
+// of it, so a seed of LORA_ENTROPY_POOL_BYTES takes roughly 2 s at the
+// default size, during which no other driver event runs.
+
+#ifndef LORA_ENTROPY_H
+#define LORA_ENTROPY_H
+
+#include "LoRa.h"
+
+// de-biased bytes folded into the key per (re)seed
+#ifndef LORA_ENTROPY_POOL_BYTES
+    #define LORA_ENTROPY_POOL_BYTES 64
+#endif
+
+// raw noise bytes read per seed before giving up
+#ifndef LORA_ENTROPY_MAX_RAW_BYTES
+    #define LORA_ENTROPY_MAX_RAW_BYTES 2048
+#endif
+
+// output between automatic reseeds
+#ifndef LORA_ENTROPY_RESEED_BYTES
+    #define LORA_ENTROPY_RESEED_BYTES 65536
+#endif
+
+// keystream generated per refill, multiple of the 64 byte ChaCha20 block
+#ifndef LORA_ENTROPY_BUFFER
+    #define LORA_ENTROPY_BUFFER 256
+#endif
+
+class LoRaEntropy {
+   public:
+    LoRaEntropy(LoRaPort* lora);
+    ~LoRaEntropy();
+
+    // samples the radio on the driver thread and waits for the reseed, or
+    // samples inline when already on it; false if the radio was busy, the
+    // noise failed the health tests or did not yield enough bits
+    bool seed();
+
+    // false until the first successful seed()
+    bool randomBytes(uint8_t* buffer, size_t size);
+    bool random(uint32_t* value);
+
+    uint32_t healthFailures();
+
+   private:
+    bool reseed();
+    bool collect(uint8_t* pool);
+    bool healthTest(uint8_t bit);
+    void resetHealthTests();
+    void mix(const uint8_t* pool);
+    void refill();
+    void handleSeed(bool* result, Semaphore* done);
+    void handleReseed();
+
+    static void chachaBlock(const uint32_t key[8], uint32_t counter,
+                            uint8_t out[64]);
+
+   private:
+    LoRaPort* _lora;
+    Mutex     _mutex;
+
+    uint32_t _key[8];
+    uint8_t  _buffer[LORA_ENTROPY_BUFFER];
+    size_t   _available;
+    uint32_t _sinceSeed;
+    bool     _seeded;
+    bool     _reseedPending;
+    uint32_t _failures;
+
+    // health test state, runs across seeds
+    uint8_t  _rctLast;
+    uint16_t _rctCount;
+    uint8_t  _aptFirst;
+    uint16_t _aptCount;
+    uint16_t _aptIndex;
+};
+
+#endif
@@ -0,0 +1,274 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaMesh.h>
+
+// table timestamps are 16-bit ticks, wrapping after ~4.6 hours; an entry
+// left untouched for a whole wrap can briefly look fresh again
+#define TICK_MS      256
+#define EXPIRY_TICKS ((LORA_MESH_EXPIRY_MS + TICK_MS - 1) / TICK_MS)
+#define TABLE_MASK   (LORA_MESH_TABLE_SIZE - 1)
+#define TABLE_SHIFT  (32 - tableBits(LORA_MESH_TABLE_SIZE))
+
+static constexpr uint8_t tableBits(uint32_t size) {
+    return size > 1 ? 1 + tableBits(size >> 1) : 0;
+}
+
+LoRaMesh::LoRaMesh(LoRaPort* lora, uint16_t address)
+    : _lora(lora),
+      _queue(lora->eventQueue()),
+      _address(address),
+      _seq(0),
+      _rng(1),
+      _duplicates(0),
+      _forwarded(0),
+      _onMessage(NULL) {
+    memset(_table, 0, sizeof(_table));
+    for (uint8_t i = 0; i < LORA_MESH_FORWARD_SLOTS; i++) {
+        _slots[i].busy = false;
+        _slots[i].event = 0;
+    }
+}
+
+void LoRaMesh::begin() {
+    _rng = _lora->random() ^ ((uint32_t)_address << 16);
+    if (_rng == 0) {
+        _rng = 1;
+    }
+
+    _lora->onReceive(callback(this, &LoRaMesh::handleReceive));
+    _lora->receive();
+}
+
+void LoRaMesh::end() {
+    _lora->onReceive(nullptr);
+
+    _mutex.lock();
+    for (int8_t i = 0; i < LORA_MESH_FORWARD_SLOTS; i++) {
+        if (_slots[i].busy && _slots[i].event) {
+            _queue->cancel(_slots[i].event);
+            releaseSlot(i);
+        }
+    }
+    _mutex.unlock();
+}
+
+uint8_t LoRaMesh::send(const uint8_t* buffer, uint8_t size, uint8_t ttl) {
+    if (size > LORA_MESH_MAX_FRAME - LORA_MESH_HEADER) {
+        return 0;
+    }
+
+    _mutex.lock();
+    int8_t index = claimSlot();
+    if (index < 0) {
+        _mutex.unlock();
+        return 0;
+    }
+
+    Slot*    slot = &_slots[index];
+    uint16_t seq = _seq++;
+    slot->data[0] = (uint8_t)(_address >> 0);
+    slot->data[1] = (uint8_t)(_address >> 8);
+    slot->data[2] = (uint8_t)(seq >> 0);
+    slot->data[3] = (uint8_t)(seq >> 8);
+    slot->data[4] = ttl;
+    memcpy(&slot->data[LORA_MESH_HEADER], buffer, size);
+    slot->length = LORA_MESH_HEADER + size;
+    slot->key = ((uint32_t)_address << 16) | seq;
+
+    // so our own frame is dropped when neighbours repeat it
+    uint8_t count;
+    checkSeen(slot->key, &count);
+    _mutex.unlock();
+
+    if (!_queue->call(this, &LoRaMesh::forward, index)) {
+        _mutex.lock();
+        releaseSlot(index);
+        _mutex.unlock();
+        return 0;
+    }
+
+    return 1;
+}
+
+void LoRaMesh::onMessage(
+    Callback<void(uint16_t, const uint8_t*, uint8_t)> cb) {
+    _onMessage = cb;
+}
+
+uint32_t LoRaMesh::duplicates() {
+    return _duplicates;
+}
+
+uint32_t LoRaMesh::forwarded() {
+    return _forwarded;
+}
+
+bool LoRaMesh::checkSeen(uint32_t key, uint8_t* count) {
+    uint16_t now = Kernel::get_ms_count() / TICK_MS;
+    // Fibonacci hashing, the top bits of the product index the table
+    uint32_t index = (key * 2654435761u) >> TABLE_SHIFT;
+    Entry*   victim = NULL;
+    uint16_t victimRank = 0;
+
+    // bounded linear probe, every slot is looked at so expired entries
+    // never hide a live one further along
+    for (uint8_t p = 0; p < LORA_MESH_MAX_PROBE; p++) {
+        Entry*   entry = &_table[(index + p) & TABLE_MASK];
+        uint16_t age = now - entry->stamp;
+        bool     live = entry->used && age < EXPIRY_TICKS;
+
+        if (live && entry->key == key) {
+            if (entry->count < 0xff) {
+                entry->count++;
+            }
+            *count = entry->count;
+            return true;
+        }
+
+        // free or expired entries first, then the oldest live one
+        uint16_t rank = live ? age : 0xffff;
+        if (!victim || rank > victimRank) {
+            victim = entry;
+            victimRank = rank;
+        }
+    }
+
+    victim->key = key;
+    victim->stamp = now;
+    victim->count = 1;
+    victim->used = 1;
+    *count = 1;
+
+    return false;
+}
+
+int8_t LoRaMesh::claimSlot() {
+    for (int8_t i = 0; i < LORA_MESH_FORWARD_SLOTS; i++) {
+        if (!_slots[i].busy) {
+            _slots[i].busy = true;
+            _slots[i].event = 0;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void LoRaMesh::releaseSlot(int8_t index) {
+    _slots[index].busy = false;
+    _slots[index].event = 0;
+}
+
+void LoRaMesh::suppress(uint32_t key) {
+    for (int8_t i = 0; i < LORA_MESH_FORWARD_SLOTS; i++) {
+        Slot* slot = &_slots[i];
+        // only relays carry an event id, our own frames always go out
+        if (slot->busy && slot->event && slot->key == key) {
+            _queue->cancel(slot->event);
+            releaseSlot(i);
+        }
+    }
+}
+
+uint32_t LoRaMesh::nextRandom() {
+    // xorshift32, only used for rebroadcast jitter
+    _rng ^= _rng << 13;
+    _rng ^= _rng >> 17;
+    _rng ^= _rng << 5;
+
+    return _rng;
+}
+
+void LoRaMesh::handleReceive(uint16_t length) {
+    if (length < LORA_MESH_HEADER || length > LORA_MESH_MAX_FRAME) {
+        return;
+    }
+
+    // read straight into a forwarding slot, or the scratch buffer if all
+    // are busy and the frame can only be delivered
+    _mutex.lock();
+    int8_t index = claimSlot();
+    _mutex.unlock();
+
+    uint8_t* frame = index >= 0 ? _slots[index].data : _scratch;
+
+    for (uint8_t i = 0; i < LORA_MESH_HEADER; i++) {
+        frame[i] = _lora->read();
+    }
+
+    uint16_t source = frame[0] | ((uint16_t)frame[1] << 8);
+    uint16_t seq = frame[2] | ((uint16_t)frame[3] << 8);
+    uint8_t  ttl = frame[4];
+    uint32_t key = ((uint32_t)source << 16) | seq;
+
+    _mutex.lock();
+    uint8_t count;
+    bool    duplicate = checkSeen(key, &count);
+    if (duplicate) {
+        _duplicates++;
+        if (count > LORA_MESH_SUPPRESS_COUNT) {
+            suppress(key);
+        }
+        if (index >= 0) {
+            releaseSlot(index);
+        }
+    }
+    _mutex.unlock();
+
+    if (duplicate) {
+        // the payload stays in the radio
+        return;
+    }
+
+    for (uint16_t i = LORA_MESH_HEADER; i < length; i++) {
+        frame[i] = _lora->read();
+    }
+
+    if (_onMessage) {
+        _onMessage(source, &frame[LORA_MESH_HEADER], length - LORA_MESH_HEADER);
+    }
+
+    if (index < 0) {
+        return;
+    }
+
+    Slot* slot = &_slots[index];
+    if (ttl <= 1) {
+        _mutex.lock();
+        releaseSlot(index);
+        _mutex.unlock();
+        return;
+    }
+
+    frame[4] = ttl - 1;
+    slot->length = length;
+    slot->key = key;
+
+    uint32_t window = LORA_MESH_DELAY_AIRTIMES * _lora->timeOnAir(length);
+    uint32_t delay = nextRandom() % (window + 1);
+
+    _mutex.lock();
+    slot->event = _queue->call_in(delay, this, &LoRaMesh::forward, index);
+    if (!slot->event) {
+        releaseSlot(index);
+    }
+    _mutex.unlock();
+}
+
+void LoRaMesh::forward(int8_t index) {
+    Slot* slot = &_slots[index];
+
+    _lora->beginPacket();
+    _lora->write(slot->data, slot->length);
+    _lora->endPacket();
+    _lora->receive();
+
+    _mutex.lock();
+    if (slot->event) {
+        _forwarded++;
+    }
+    releaseSlot(index);
+    _mutex.unlock();
+}
@@ -0,0 +1,132 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Flooding mesh forwarder.
+//
+// Every frame starts with
+//
+//   source(2, LE) sequence(2, LE) ttl(1)
+//
+// Duplicates are detected from the header alone through a fixed-size,
+// open-addressed table of (source, sequence) keys with time-based expiry, so
+// the payload of a duplicate is never read out of the radio. New frames are
+// read straight into a forwarding slot, delivered from there, and, with the
+// TTL decremented in place, rebroadcast from the same buffer after a random
+// delay of up to LORA_MESH_DELAY_AIRTIMES times their airtime. A pending
+// rebroadcast is cancelled once enough neighbours have been heard repeating
+// the frame.
+
+#ifndef LORA_MESH_H
+#define LORA_MESH_H
+
+#include "LoRa.h"
+
+#define LORA_MESH_HEADER 5
+
+// seen-packet table entries, power of two
+#ifndef LORA_MESH_TABLE_SIZE
+    #define LORA_MESH_TABLE_SIZE 128
+#endif
+
+// table slots inspected per lookup
+#ifndef LORA_MESH_MAX_PROBE
+    #define LORA_MESH_MAX_PROBE 8
+#endif
+
+#ifndef LORA_MESH_EXPIRY_MS
+    #define LORA_MESH_EXPIRY_MS 30000
+#endif
+
+// frames held for rebroadcast at once
+#ifndef LORA_MESH_FORWARD_SLOTS
+    #define LORA_MESH_FORWARD_SLOTS 4
+#endif
+
+#ifndef LORA_MESH_MAX_FRAME
+    #define LORA_MESH_MAX_FRAME 128
+#endif
+
+#ifndef LORA_MESH_DEFAULT_TTL
+    #define LORA_MESH_DEFAULT_TTL 4
+#endif
+
+// upper bound of the rebroadcast delay, in airtimes of the frame
+#ifndef LORA_MESH_DELAY_AIRTIMES
+    #define LORA_MESH_DELAY_AIRTIMES 4
+#endif
+
+// duplicates heard before a pending rebroadcast is dropped
+#ifndef LORA_MESH_SUPPRESS_COUNT
+    #define LORA_MESH_SUPPRESS_COUNT 2
+#endif
+
+#if (LORA_MESH_TABLE_SIZE < 2) || \
+    (LORA_MESH_TABLE_SIZE & (LORA_MESH_TABLE_SIZE - 1))
+    #error "LORA_MESH_TABLE_SIZE must be a power of two of at least 2"
+#endif
+
+class LoRaMesh {
+   public:
+    LoRaMesh(LoRaPort* lora, uint16_t address);
+
+    // takes over the port's receive callback and puts it in RX mode
+    void begin();
+    void end();
+
+    // floods a new frame, 0 if it is too large or no slot is free
+    uint8_t send(const uint8_t* buffer, uint8_t size,
+                 uint8_t ttl = LORA_MESH_DEFAULT_TTL);
+
+    // source, payload and its length; the payload points into the
+    // forwarding buffer and is only valid during the callback
+    void onMessage(Callback<void(uint16_t, const uint8_t*, uint8_t)> cb);
+
+    uint32_t duplicates();
+    uint32_t forwarded();
+
+   private:
+    // 8 bytes so a whole probe sequence spans a cache line or two
+    struct Entry {
+        uint32_t key;
+        uint16_t stamp;  // in ticks of TICK_MS
+        uint8_t  count;
+        uint8_t  used;
+    };
+
+    struct Slot {
+        bool     busy;
+        uint32_t key;
+        int      event;
+        uint8_t  length;
+        uint8_t  data[LORA_MESH_MAX_FRAME];
+    };
+
+    bool     checkSeen(uint32_t key, uint8_t* count);
+    int8_t   claimSlot();
+    void     releaseSlot(int8_t index);
+    void     suppress(uint32_t key);
+    uint32_t nextRandom();
+
+    void handleReceive(uint16_t length);
+    void forward(int8_t index);
+
+   private:
+    LoRaPort*   _lora;
+    EventQueue* _queue;
+    Mutex       _mutex;
+
+    uint16_t _address;
+    uint16_t _seq;
+    uint32_t _rng;
+    uint32_t _duplicates;
+    uint32_t _forwarded;
+
+    Entry   _table[LORA_MESH_TABLE_SIZE];
+    Slot    _slots[LORA_MESH_FORWARD_SLOTS];
+    uint8_t _scratch[LORA_MESH_MAX_FRAME];
+
+    Callback<void(uint16_t, const uint8_t*, uint8_t)> _onMessage;
+};
+
+#endif
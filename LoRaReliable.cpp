@@ -0,0 +1,428 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaReliable.h>
+
+// frame types
+#define FRAME_DATA    0x01
+#define FRAME_ACK     0x02
+#define FRAME_ACK_REQ 0x80
+
+// slot states
+#define SLOT_FREE     0
+#define SLOT_QUEUED   1  // waiting for (re)transmission
+#define SLOT_INFLIGHT 2  // sent, waiting for the ACK of its burst
+#define SLOT_DONE     3  // acknowledged or given up, not yet slid out
+
+#define WINDOW_MASK (LORA_RELIABLE_MAX_WINDOW - 1)
+#define HALF_SPACE  128  // forward half of the 8-bit sequence space
+#define MAX_BACKOFF 4
+
+LoRaReliable::LoRaReliable(LoRaPort* lora)
+    : _lora(lora),
+      _queue(lora->eventQueue()),
+      _window(LORA_RELIABLE_MAX_WINDOW),
+      _sndBase(0),
+      _sndNext(0),
+      _awaitingAck(false),
+      _pumpScheduled(false),
+      _timeoutEvent(0),
+      _backoff(0),
+      _rcvBase(0),
+      _ackEvent(0),
+      _onData(NULL),
+      _onSent(NULL) {
+    for (uint8_t i = 0; i < LORA_RELIABLE_MAX_WINDOW; i++) {
+        _tx[i].state = SLOT_FREE;
+        _rx[i].state = SLOT_FREE;
+    }
+}
+
+LoRaReliable::~LoRaReliable() {
+    end();
+}
+
+void LoRaReliable::begin(uint8_t window) {
+    setWindow(window);
+
+    _lora->onReceive(callback(this, &LoRaReliable::handleReceive));
+    _lora->receive();
+}
+
+void LoRaReliable::end() {
+    if (_timeoutEvent) {
+        _queue->cancel(_timeoutEvent);
+        _timeoutEvent = 0;
+    }
+    if (_ackEvent) {
+        _queue->cancel(_ackEvent);
+        _ackEvent = 0;
+    }
+    _lora->onReceive(nullptr);
+}
+
+void LoRaReliable::setWindow(uint8_t window) {
+    if (window < 1) {
+        window = 1;
+    } else if (window > LORA_RELIABLE_MAX_WINDOW) {
+        window = LORA_RELIABLE_MAX_WINDOW;
+    }
+
+    _mutex.lock();
+    _window = window;
+    _mutex.unlock();
+}
+
+uint8_t LoRaReliable::window() {
+    return _window;
+}
+
+int16_t LoRaReliable::send(const uint8_t* buffer, uint8_t size) {
+    if (size > LORA_RELIABLE_MAX_PAYLOAD) {
+        return -1;
+    }
+
+    _mutex.lock();
+    if ((uint8_t)(_sndNext - _sndBase) >= _window) {
+        _mutex.unlock();
+        return -1;
+    }
+
+    Slot* slot = &_tx[_sndNext & WINDOW_MASK];
+    memcpy(slot->data, buffer, size);
+    slot->length = size;
+    slot->seq = _sndNext;
+    slot->retries = 0;
+    slot->state = SLOT_QUEUED;
+    uint8_t seq = _sndNext++;
+    _mutex.unlock();
+
+    schedulePump();
+    return seq;
+}
+
+uint8_t LoRaReliable::pending() {
+    _mutex.lock();
+    uint8_t count = _sndNext - _sndBase;
+    _mutex.unlock();
+
+    return count;
+}
+
+void LoRaReliable::onData(Callback<void(const uint8_t*, uint8_t)> cb) {
+    _onData = cb;
+}
+
+void LoRaReliable::onSent(Callback<void(uint8_t, bool)> cb) {
+    _onSent = cb;
+}
+
+void LoRaReliable::schedulePump() {
+    _mutex.lock();
+    bool post = !_pumpScheduled;
+    _pumpScheduled = true;
+    _mutex.unlock();
+
+    if (post && !_queue->call(this, &LoRaReliable::pump)) {
+        // event queue full, the next send() or ACK retries
+        _mutex.lock();
+        _pumpScheduled = false;
+        _mutex.unlock();
+    }
+}
+
+void LoRaReliable::pump() {
+    uint8_t burst[LORA_RELIABLE_MAX_WINDOW];
+    uint8_t failed[LORA_RELIABLE_MAX_WINDOW];
+    uint8_t count = 0;
+    uint8_t failures = 0;
+
+    _mutex.lock();
+    _pumpScheduled = false;
+    if (_awaitingAck) {
+        // the ACK or the retransmit timeout pumps again
+        _mutex.unlock();
+        return;
+    }
+
+    for (uint8_t seq = _sndBase; seq != _sndNext; seq++) {
+        Slot* slot = &_tx[seq & WINDOW_MASK];
+        if (slot->state != SLOT_QUEUED) {
+            continue;
+        }
+
+        if (slot->retries >= LORA_RELIABLE_MAX_RETRIES) {
+            slot->state = SLOT_DONE;
+            failed[failures++] = seq;
+            continue;
+        }
+
+        slot->state = SLOT_INFLIGHT;
+        slot->retries++;
+        burst[count++] = seq & WINDOW_MASK;
+    }
+    advanceSendBase();
+    _awaitingAck = count > 0;
+    _mutex.unlock();
+
+    if (_onSent) {
+        for (uint8_t i = 0; i < failures; i++) {
+            _onSent(failed[i], false);
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    // slots in flight are only touched by this thread, send them unlocked
+    for (uint8_t i = 0; i < count; i++) {
+        Slot*   slot = &_tx[burst[i]];
+        uint8_t header[LORA_RELIABLE_DATA_HEADER];
+
+        header[0] = FRAME_DATA | ((i == count - 1) ? FRAME_ACK_REQ : 0);
+        header[1] = slot->seq;
+        header[2] = _sndBase;
+
+        _lora->beginPacket();
+        _lora->write(header, sizeof(header));
+        _lora->write(slot->data, slot->length);
+        _lora->endPacket();
+    }
+
+    _lora->receive();
+    _timeoutEvent = _queue->call_in(retransmitTimeout(), this,
+                                    &LoRaReliable::handleTimeout);
+}
+
+void LoRaReliable::handleTimeout() {
+    _timeoutEvent = 0;
+
+    _mutex.lock();
+    for (uint8_t seq = _sndBase; seq != _sndNext; seq++) {
+        Slot* slot = &_tx[seq & WINDOW_MASK];
+        if (slot->state == SLOT_INFLIGHT) {
+            slot->state = SLOT_QUEUED;
+        }
+    }
+    _awaitingAck = false;
+    if (_backoff < MAX_BACKOFF) {
+        _backoff++;
+    }
+    _mutex.unlock();
+
+    pump();
+}
+
+void LoRaReliable::handleReceive(uint16_t length) {
+    if (length < 1) {
+        return;
+    }
+
+    uint8_t type = _lora->read();
+
+    if ((type & ~FRAME_ACK_REQ) == FRAME_DATA) {
+        handleData(type, length - 1);
+    } else if (type == FRAME_ACK && length == LORA_RELIABLE_ACK_LENGTH) {
+        handleAck();
+    }
+}
+
+void LoRaReliable::handleData(uint8_t type, uint16_t length) {
+    if (length < LORA_RELIABLE_DATA_HEADER - 1 ||
+        length - (LORA_RELIABLE_DATA_HEADER - 1) > LORA_RELIABLE_MAX_PAYLOAD) {
+        return;
+    }
+
+    uint8_t seq = _lora->read();
+    uint8_t base = _lora->read();
+    uint8_t size = length - (LORA_RELIABLE_DATA_HEADER - 1);
+
+    // the sender's base is authoritative, it is where its window starts
+    advanceReceiveBase(base);
+
+    if ((uint8_t)(seq - _rcvBase) < LORA_RELIABLE_MAX_WINDOW) {
+        Slot* slot = &_rx[seq & WINDOW_MASK];
+        if (slot->state == SLOT_FREE) {
+            for (uint8_t i = 0; i < size; i++) {
+                slot->data[i] = _lora->read();
+            }
+            slot->length = size;
+            slot->seq = seq;
+            slot->state = SLOT_DONE;
+        }
+        deliverInOrder();
+    }
+
+    // duplicates are acknowledged too, the previous ACK may have been lost
+    if (type & FRAME_ACK_REQ) {
+        sendAck();
+        return;
+    }
+
+    // more of the burst may follow; if its last frame is lost, acknowledge
+    // once the channel has been quiet for a frame
+    if (_ackEvent) {
+        _queue->cancel(_ackEvent);
+    }
+    _ackEvent =
+        _queue->call_in(ackDelay(), this, &LoRaReliable::handleAckDelay);
+}
+
+void LoRaReliable::handleAckDelay() {
+    _ackEvent = 0;
+    sendAck();
+}
+
+void LoRaReliable::handleAck() {
+    uint8_t  ackBase = _lora->read();
+    uint16_t bitmap = _lora->read();
+    bitmap |= (uint16_t)_lora->read() << 8;
+
+    uint8_t acked[LORA_RELIABLE_MAX_WINDOW];
+    uint8_t count = 0;
+
+    _mutex.lock();
+    uint8_t outstanding = _sndNext - _sndBase;
+    uint8_t cumulative = ackBase - _sndBase;
+    bool    outside = cumulative > outstanding;
+    if (outside) {
+        // stale, or from a peer out of step whose bitmap means nothing
+        // here; the resent burst carries our base and the peer follows it
+        cumulative = 0;
+    }
+
+    for (uint8_t i = 0; i < outstanding; i++) {
+        uint8_t seq = _sndBase + i;
+        Slot*   slot = &_tx[seq & WINDOW_MASK];
+        if (slot->state != SLOT_INFLIGHT && slot->state != SLOT_QUEUED) {
+            continue;
+        }
+
+        uint8_t rel = seq - ackBase;
+        bool    selective = !outside && rel >= 1 && rel <= 16 &&
+                         (bitmap & (1u << (rel - 1)));
+        if (i < cumulative || selective) {
+            slot->state = SLOT_DONE;
+            acked[count++] = seq;
+        } else if (slot->state == SLOT_INFLIGHT) {
+            // the ACK answers the end of the burst, anything missing is lost
+            slot->state = SLOT_QUEUED;
+        }
+    }
+    advanceSendBase();
+    _awaitingAck = false;
+    _backoff = 0;
+    _mutex.unlock();
+
+    if (_timeoutEvent) {
+        _queue->cancel(_timeoutEvent);
+        _timeoutEvent = 0;
+    }
+
+    if (_onSent) {
+        for (uint8_t i = 0; i < count; i++) {
+            _onSent(acked[i], true);
+        }
+    }
+
+    pump();
+}
+
+void LoRaReliable::sendAck() {
+    uint16_t bitmap = 0;
+
+    if (_ackEvent) {
+        _queue->cancel(_ackEvent);
+        _ackEvent = 0;
+    }
+
+    for (uint8_t i = 0; i < LORA_RELIABLE_MAX_WINDOW - 1; i++) {
+        uint8_t seq = _rcvBase + 1 + i;
+        Slot*   slot = &_rx[seq & WINDOW_MASK];
+        if (slot->state == SLOT_DONE && slot->seq == seq) {
+            bitmap |= 1u << i;
+        }
+    }
+
+    uint8_t frame[LORA_RELIABLE_ACK_LENGTH] = {
+        FRAME_ACK, _rcvBase, (uint8_t)(bitmap & 0xff), (uint8_t)(bitmap >> 8)};
+
+    _lora->beginPacket();
+    _lora->write(frame, sizeof(frame));
+    _lora->endPacket();
+    _lora->receive();
+}
+
+void LoRaReliable::advanceSendBase() {
+    while (_sndBase != _sndNext &&
+           _tx[_sndBase & WINDOW_MASK].state == SLOT_DONE) {
+        _tx[_sndBase & WINDOW_MASK].state = SLOT_FREE;
+        _sndBase++;
+    }
+}
+
+void LoRaReliable::advanceReceiveBase(uint8_t base) {
+    uint8_t behind = _rcvBase - base;
+    if (behind <= LORA_RELIABLE_MAX_WINDOW) {
+        // in step, or resending frames whose ACK was lost
+        return;
+    }
+
+    uint8_t gap = base - _rcvBase;
+    if (gap < HALF_SPACE) {
+        // the sender gave up on everything before its base, hand over what
+        // is held of it; a gap wider than the window frees every slot
+        uint8_t held = gap;
+        if (held > LORA_RELIABLE_MAX_WINDOW) {
+            held = LORA_RELIABLE_MAX_WINDOW;
+        }
+        for (uint8_t i = 0; i < held; i++) {
+            uint8_t seq = _rcvBase + i;
+            Slot*   slot = &_rx[seq & WINDOW_MASK];
+            if (slot->state == SLOT_DONE && slot->seq == seq && _onData) {
+                _onData(slot->data, slot->length);
+            }
+            slot->state = SLOT_FREE;
+        }
+    } else {
+        // too far behind to be a lagging retransmission, the sender has
+        // restarted and nothing held belongs to its new sequence space
+        for (uint8_t i = 0; i < LORA_RELIABLE_MAX_WINDOW; i++) {
+            _rx[i].state = SLOT_FREE;
+        }
+    }
+
+    _rcvBase = base;
+    deliverInOrder();
+}
+
+void LoRaReliable::deliverInOrder() {
+    Slot* slot = &_rx[_rcvBase & WINDOW_MASK];
+
+    while (slot->state == SLOT_DONE && slot->seq == _rcvBase) {
+        if (_onData) {
+            _onData(slot->data, slot->length);
+        }
+        slot->state = SLOT_FREE;
+        _rcvBase++;
+        slot = &_rx[_rcvBase & WINDOW_MASK];
+    }
+}
+
+uint32_t LoRaReliable::ackDelay() {
+    // frames of a burst follow each other within one turnaround
+    return _lora->timeOnAir(LORA_RELIABLE_DATA_HEADER +
+                            LORA_RELIABLE_MAX_PAYLOAD) +
+           2 * LORA_RELIABLE_TURNAROUND_MS;
+}
+
+uint32_t LoRaReliable::retransmitTimeout() {
+    // armed after the last frame of the burst left the antenna; if that frame
+    // was lost the peer only answers once its ACK delay runs out
+    uint32_t rto = ackDelay() + _lora->timeOnAir(LORA_RELIABLE_ACK_LENGTH) +
+                   2 * LORA_RELIABLE_TURNAROUND_MS;
+
+    return rto << _backoff;
+}
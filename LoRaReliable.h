@@ -0,0 +1,120 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Selective-repeat reliable transport on top of LoRaPort.
+//
+// Frames queued with send() are transmitted back to back as a burst of up to
+// `window` frames, the last one flagged to request an acknowledgement. The
+// receiver answers with a single ACK carrying its cumulative sequence number
+// plus a bitmap of the frames it holds beyond it, so only the missing frames
+// are sent again. If the flagged frame is lost the receiver still acknowledges
+// once no further frame has arrived for one frame airtime. Every data frame
+// carries the sender's window base and the receiver always follows it, so
+// the two ends resync after either restarts or a whole window is given up.
+// All buffers are sized at compile time.
+
+#ifndef LORA_RELIABLE_H
+#define LORA_RELIABLE_H
+
+#include "LoRa.h"
+
+// frames in flight, power of two and at most 16 (width of the SACK bitmap)
+#ifndef LORA_RELIABLE_MAX_WINDOW
+    #define LORA_RELIABLE_MAX_WINDOW 8
+#endif
+
+// largest payload accepted by send()
+#ifndef LORA_RELIABLE_MAX_PAYLOAD
+    #define LORA_RELIABLE_MAX_PAYLOAD 64
+#endif
+
+// transmissions of a frame before it is reported as failed
+#ifndef LORA_RELIABLE_MAX_RETRIES
+    #define LORA_RELIABLE_MAX_RETRIES 8
+#endif
+
+// allowance for RX/TX switching and ACK processing at the peer
+#ifndef LORA_RELIABLE_TURNAROUND_MS
+    #define LORA_RELIABLE_TURNAROUND_MS 20
+#endif
+
+#if (LORA_RELIABLE_MAX_WINDOW & (LORA_RELIABLE_MAX_WINDOW - 1)) || \
+    (LORA_RELIABLE_MAX_WINDOW > 16)
+    #error "LORA_RELIABLE_MAX_WINDOW must be a power of two no larger than 16"
+#endif
+
+#define LORA_RELIABLE_DATA_HEADER 3
+#define LORA_RELIABLE_ACK_LENGTH  4
+
+class LoRaReliable {
+   public:
+    LoRaReliable(LoRaPort* lora);
+    ~LoRaReliable();
+
+    // takes over the port's receive callback and puts it in RX mode
+    void begin(uint8_t window = LORA_RELIABLE_MAX_WINDOW);
+    void end();
+
+    void    setWindow(uint8_t window);
+    uint8_t window();
+
+    // copies the frame into the send window, returns the sequence number
+    // later passed to onSent(), or -1 if the window is full
+    int16_t send(const uint8_t* buffer, uint8_t size);
+    uint8_t pending();
+
+    // in-order delivery of received frames, on the driver thread
+    void onData(Callback<void(const uint8_t*, uint8_t)> cb);
+    // result for each frame passed to send(), on the driver thread
+    void onSent(Callback<void(uint8_t, bool)> cb);
+
+   private:
+    struct Slot {
+        uint8_t state;
+        uint8_t seq;
+        uint8_t length;
+        uint8_t retries;
+        uint8_t data[LORA_RELIABLE_MAX_PAYLOAD];
+    };
+
+    void schedulePump();
+    void pump();
+    void handleTimeout();
+    void handleReceive(uint16_t length);
+    void handleData(uint8_t type, uint16_t length);
+    void handleAck();
+    void sendAck();
+    void handleAckDelay();
+
+    void advanceSendBase();
+    void advanceReceiveBase(uint8_t base);
+    void deliverInOrder();
+
+    uint32_t ackDelay();
+    uint32_t retransmitTimeout();
+
+   private:
+    LoRaPort*   _lora;
+    EventQueue* _queue;
+    Mutex       _mutex;
+
+    uint8_t _window;
+    uint8_t _sndBase;
+    uint8_t _sndNext;
+    bool    _awaitingAck;
+    bool    _pumpScheduled;
+    int     _timeoutEvent;
+    uint8_t _backoff;
+
+    uint8_t _rcvBase;
+    int     _ackEvent;
+
+    Slot _tx[LORA_RELIABLE_MAX_WINDOW];
+    Slot _rx[LORA_RELIABLE_MAX_WINDOW];
+
+    Callback<void(const uint8_t*, uint8_t)> _onData;
+    Callback<void(uint8_t, bool)>           _onSent;
+};
+
+#endif
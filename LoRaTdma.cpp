@@ -0,0 +1,257 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaTdma.h>
+
+// beacons further apart than this are not used for drift estimation
+#define MAX_DRIFT_FRAMES 8
+
+// retry interval when the queue is full at the slot start
+#define FIRE_RETRY_US 1000
+
+LoRaTdma::LoRaTdma(LoRaPort* lora, uint8_t slot, uint8_t maxPayload)
+    : _lora(lora),
+      _queue(lora->eventQueue()),
+      _slot(slot),
+      _maxPayload(maxPayload),
+      _pendingLength(0),
+      _hasPending(false),
+      _loaded(false),
+      _fireAt(0),
+      _synced(false),
+      _beaconSeq(0),
+      _beaconTime(0),
+      _periodMs(0),
+      _slots(0),
+      _drift(0),
+      _onData(NULL),
+      _onSent(NULL) {
+    if (_maxPayload > LORA_TDMA_MAX_PAYLOAD) {
+        _maxPayload = LORA_TDMA_MAX_PAYLOAD;
+    }
+}
+
+void LoRaTdma::begin() {
+    _lora->onReceive(callback(this, &LoRaTdma::handleReceive));
+    _lora->onTxDone(callback(this, &LoRaTdma::handleTxDone));
+    _lora->receive();
+}
+
+void LoRaTdma::end() {
+    _loadTimer.detach();
+    _fireTimer.detach();
+    _lora->onReceive(nullptr);
+    _lora->onTxDone(nullptr);
+    _synced = false;
+
+    // a load or fire event still queued finds nothing to do
+    _mutex.lock();
+    _hasPending = false;
+    _loaded = false;
+    _mutex.unlock();
+}
+
+uint8_t LoRaTdma::send(const uint8_t* buffer, uint8_t size) {
+    if (size > _maxPayload) {
+        return 0;
+    }
+
+    _mutex.lock();
+    if (_hasPending) {
+        _mutex.unlock();
+        return 0;
+    }
+
+    memcpy(_pending, buffer, size);
+    _pendingLength = size;
+    _hasPending = true;
+    _mutex.unlock();
+
+    return 1;
+}
+
+bool LoRaTdma::synced() {
+    return _synced;
+}
+
+float LoRaTdma::driftPpm() {
+    return _drift;
+}
+
+uint32_t LoRaTdma::slotLength() {
+    // timeOnAir() rounds down to whole ms, one byte for the frame type
+    uint32_t airtime = (_lora->timeOnAir(_maxPayload + 1) + 1) * 1000;
+
+    return airtime + 2 * guardTime();
+}
+
+uint32_t LoRaTdma::guardTime() {
+    // both clocks may be off by the tolerance in opposite directions, and
+    // the error grows with the distance from the beacon, at most one period
+    uint32_t drift = (uint64_t)2 * LORA_TDMA_DRIFT_PPM * _periodMs / 1000;
+
+    return drift + LORA_TDMA_JITTER_US;
+}
+
+void LoRaTdma::onData(Callback<void(uint16_t)> cb) {
+    _onData = cb;
+}
+
+void LoRaTdma::onSent(Callback<void()> cb) {
+    _onSent = cb;
+}
+
+void LoRaTdma::handleReceive(uint16_t length) {
+    if (length == 0) {
+        return;
+    }
+
+    uint8_t type = _lora->read();
+    if (type == LORA_TDMA_BEACON && length == LORA_TDMA_BEACON_LENGTH) {
+        handleBeacon();
+    } else if (type == LORA_TDMA_DATA && _onData) {
+        _onData(length - 1);
+    }
+}
+
+void LoRaTdma::handleBeacon() {
+    // RxDone of the beacon marks the start of the frame
+    us_timestamp_t stamp = _lora->packetTimestamp();
+
+    uint8_t  seq = _lora->read();
+    uint16_t periodMs = _lora->read();
+    periodMs |= (uint16_t)_lora->read() << 8;
+    uint8_t slots = _lora->read();
+
+    uint8_t frames = seq - _beaconSeq;
+    if (_synced && periodMs == _periodMs && frames > 0 &&
+        frames <= MAX_DRIFT_FRAMES) {
+        float nominal = (float)frames * periodMs * 1000;
+        float measured = ((float)(stamp - _beaconTime) - nominal) / nominal;
+        measured *= 1E6;
+
+        // a beacon lost and confused with a later one shows up as a huge
+        // offset, anything beyond the combined tolerance is ignored
+        if (fabs(measured) <= 2 * LORA_TDMA_DRIFT_PPM) {
+            _drift += (measured - _drift) / 4;
+        }
+    }
+
+    _beaconTime = stamp;
+    _beaconSeq = seq;
+    _periodMs = periodMs;
+    _slots = slots;
+    _synced = true;
+
+    scheduleSlot();
+}
+
+void LoRaTdma::scheduleSlot() {
+    _mutex.lock();
+    bool ready = _hasPending && !_loaded;
+    _mutex.unlock();
+
+    if (!ready || _slot >= _slots) {
+        return;
+    }
+
+    uint32_t slot = slotLength();
+    uint32_t guard = guardTime();
+
+    if ((uint64_t)(_slot + 1) * slot + guard > (uint64_t)_periodMs * 1000) {
+        // the airtime model does not fit this slot into the period
+        return;
+    }
+
+    // transmit guard time into the slot, converted to the local clock
+    float offset = guard + (float)_slot * slot + guard;
+    offset *= 1 + _drift / 1E6;
+
+    us_timestamp_t fireAt = _beaconTime + (us_timestamp_t)offset;
+    us_timestamp_t now = _lora->timestamp();
+    if (fireAt < now + LORA_TDMA_LOAD_LEAD_US) {
+        // too late for this frame, wait for the next beacon
+        return;
+    }
+
+    _fireAt = fireAt;
+    _loadTimer.attach_us(callback(this, &LoRaTdma::loadIsr),
+                         fireAt - now - LORA_TDMA_LOAD_LEAD_US);
+    _fireTimer.attach_us(callback(this, &LoRaTdma::fireIsr), fireAt - now);
+}
+
+void LoRaTdma::loadIsr() {
+    if (!_queue->call(this, &LoRaTdma::loadSlot)) {
+        // nothing loaded, the frame waits for the next beacon
+        _fireTimer.detach();
+    }
+}
+
+void LoRaTdma::fireIsr() {
+    if (!_queue->call(this, &LoRaTdma::fireSlot)) {
+        // the FIFO may hold the frame with the receiver off, keep trying so
+        // fireSlot() can send it or put the radio back in RX
+        _fireTimer.attach_us(callback(this, &LoRaTdma::fireIsr),
+                             FIRE_RETRY_US);
+    }
+}
+
+void LoRaTdma::loadSlot() {
+    _mutex.lock();
+    if (!_hasPending || _loaded) {
+        _mutex.unlock();
+        return;
+    }
+
+    if (!_lora->beginPacket()) {
+        _mutex.unlock();
+        _fireTimer.detach();
+        return;
+    }
+
+    _lora->write(LORA_TDMA_DATA);
+    _lora->write(_pending, _pendingLength);
+    _loaded = true;
+    _mutex.unlock();
+}
+
+void LoRaTdma::fireSlot() {
+    _mutex.lock();
+    bool loaded = _loaded;
+    _mutex.unlock();
+
+    if (!loaded) {
+        return;
+    }
+
+    if (_lora->timestamp() > _fireAt + guardTime()) {
+        // too late to finish inside the slot
+        abortSlot();
+        return;
+    }
+
+    _lora->endPacket(true);
+}
+
+void LoRaTdma::abortSlot() {
+    // the frame stays pending for the next beacon
+    _mutex.lock();
+    _loaded = false;
+    _mutex.unlock();
+
+    _lora->receive();
+}
+
+void LoRaTdma::handleTxDone() {
+    _mutex.lock();
+    _hasPending = false;
+    _loaded = false;
+    _mutex.unlock();
+
+    _lora->receive();
+
+    if (_onSent) {
+        _onSent();
+    }
+}
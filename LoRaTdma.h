@@ -0,0 +1,113 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// TDMA node MAC synchronised to a gateway beacon.
+//
+// The gateway opens every frame with a beacon
+//
+//   type(1) = LORA_TDMA_BEACON, sequence(1), period_ms(2, LE), slots(1)
+//
+// while node frames carry type(1) = LORA_TDMA_DATA ahead of the payload, so a
+// data frame is never taken for a beacon. Slot k starts guardTime() +
+// k * slotLength() after the end of the beacon. Frame start times are taken
+// from the DIO0 timestamp of the beacon's RxDone, the local clock drift is
+// estimated from successive beacons, and a frame queued with send() is put on
+// air guardTime() into the node's slot of the next frame whose beacon is
+// heard. The slot length covers the airtime of the largest frame plus a guard
+// on each side sized for the worst-case clock disagreement over one period.
+
+#ifndef LORA_TDMA_H
+#define LORA_TDMA_H
+
+#include "LoRa.h"
+
+#define LORA_TDMA_BEACON        0xbe
+#define LORA_TDMA_BEACON_LENGTH 5
+#define LORA_TDMA_DATA          0xda
+
+// crystal tolerance of each end
+#ifndef LORA_TDMA_DRIFT_PPM
+    #define LORA_TDMA_DRIFT_PPM 50
+#endif
+
+// interrupt latency, event dispatch and PA ramp allowance
+#ifndef LORA_TDMA_JITTER_US
+    #define LORA_TDMA_JITTER_US 2000
+#endif
+
+// how early the payload is loaded into the FIFO before the slot
+#ifndef LORA_TDMA_LOAD_LEAD_US
+    #define LORA_TDMA_LOAD_LEAD_US 5000
+#endif
+
+#ifndef LORA_TDMA_MAX_PAYLOAD
+    #define LORA_TDMA_MAX_PAYLOAD 64
+#endif
+
+class LoRaTdma {
+   public:
+    LoRaTdma(LoRaPort* lora, uint8_t slot,
+             uint8_t maxPayload = LORA_TDMA_MAX_PAYLOAD);
+
+    // takes over the port's receive and TX done callbacks
+    void begin();
+    void end();
+
+    // queues a frame for the node's next slot, 0 if one is already queued
+    uint8_t send(const uint8_t* buffer, uint8_t size);
+
+    bool  synced();
+    float driftPpm();
+
+    // in us, from the current airtime model and beacon period
+    uint32_t slotLength();
+    uint32_t guardTime();
+
+    // data frames, read as with LoRaPort::onReceive once the type byte has
+    // been consumed; the length excludes it
+    void onData(Callback<void(uint16_t)> cb);
+    void onSent(Callback<void()> cb);
+
+   private:
+    void handleReceive(uint16_t length);
+    void handleBeacon();
+    void handleTxDone();
+    void scheduleSlot();
+
+    void loadIsr();
+    void fireIsr();
+    void loadSlot();
+    void fireSlot();
+    void abortSlot();
+
+   private:
+    LoRaPort*   _lora;
+    EventQueue* _queue;
+    Mutex       _mutex;
+
+    ALIAS_LORAWAN_TIMER _loadTimer;
+    ALIAS_LORAWAN_TIMER _fireTimer;
+
+    uint8_t _slot;
+    uint8_t _maxPayload;
+
+    uint8_t _pending[LORA_TDMA_MAX_PAYLOAD];
+    uint8_t _pendingLength;
+    bool    _hasPending;
+    bool    _loaded;
+
+    us_timestamp_t _fireAt;
+
+    bool           _synced;
+    uint8_t        _beaconSeq;
+    us_timestamp_t _beaconTime;
+    uint16_t       _periodMs;
+    uint8_t        _slots;
+    float          _drift;  // ppm of the local clock against the gateway
+
+    Callback<void(uint16_t)> _onData;
+    Callback<void()>         _onSent;
+};
+
+#endif
@@ -0,0 +1,186 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+#include <LoRaTrace.h>
+#include <string.h>
+
+static void putU16(uint8_t* out, uint16_t value) {
+    out[0] = (uint8_t)(value >> 0);
+    out[1] = (uint8_t)(value >> 8);
+}
+
+static void putU32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 0);
+    out[1] = (uint8_t)(value >> 8);
+    out[2] = (uint8_t)(value >> 16);
+    out[3] = (uint8_t)(value >> 24);
+}
+
+static void putU64(uint8_t* out, uint64_t value) {
+    putU32(&out[0], (uint32_t)value);
+    putU32(&out[4], (uint32_t)(value >> 32));
+}
+
+static uint16_t getU16(const uint8_t* in) {
+    return (uint16_t)in[0] | ((uint16_t)in[1] << 8);
+}
+
+static uint32_t getU32(const uint8_t* in) {
+    return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+           ((uint32_t)in[3] << 24);
+}
+
+static uint64_t getU64(const uint8_t* in) {
+    return (uint64_t)getU32(&in[0]) | ((uint64_t)getU32(&in[4]) << 32);
+}
+
+void LoRaTrace::encode(const LoRaTraceRecord& record, uint8_t* header) {
+    header[0] = LORA_TRACE_MAGIC;
+    header[1] = record.length;
+    putU64(&header[2], record.timestamp_us);
+    putU32(&header[10], record.frequency);
+    putU32(&header[14], (uint32_t)record.frequency_error);
+    putU16(&header[18], (uint16_t)record.rssi);
+    header[20] = (uint8_t)record.snr;
+    header[21] = record.irq_flags;
+    header[22] = record.spreading_factor;
+    header[23] = record.coding_rate;
+    putU32(&header[24], record.bandwidth);
+    header[28] = record.flags;
+    putU16(&header[29], record.preamble_length);
+}
+
+bool LoRaTrace::decode(const uint8_t* header, LoRaTraceRecord* record) {
+    if (header[0] != LORA_TRACE_MAGIC) {
+        return false;
+    }
+
+    record->length = header[1];
+    record->timestamp_us = getU64(&header[2]);
+    record->frequency = getU32(&header[10]);
+    record->frequency_error = (int32_t)getU32(&header[14]);
+    record->rssi = (int16_t)getU16(&header[18]);
+    record->snr = (int8_t)header[20];
+    record->irq_flags = header[21];
+    record->spreading_factor = header[22];
+    record->coding_rate = header[23];
+    record->bandwidth = getU32(&header[24]);
+    record->flags = header[28];
+    record->preamble_length = getU16(&header[29]);
+
+    return true;
+}
+
+LoRaTraceRing::LoRaTraceRing(uint8_t* storage, size_t size)
+    : _storage(storage), _size(size), _head(0), _used(0), _dropped(0) {
+}
+
+bool LoRaTraceRing::append(const LoRaTraceRecord& record,
+                           const uint8_t* payload) {
+    size_t total = LORA_TRACE_HEADER_LENGTH + record.length;
+
+    if (total > _size) {
+        _dropped++;
+        return false;
+    }
+
+    // make room by discarding the oldest records
+    while (_size - _used < total) {
+        _used -= recordLength((_head + _size - _used) % _size);
+        _dropped++;
+    }
+
+    uint8_t header[LORA_TRACE_HEADER_LENGTH];
+    LoRaTrace::encode(record, header);
+
+    put(header, sizeof(header));
+    put(payload, record.length);
+
+    return true;
+}
+
+size_t LoRaTraceRing::drain(uint8_t* buffer, size_t size) {
+    size_t copied = 0;
+
+    while (_used > 0) {
+        size_t tail = (_head + _size - _used) % _size;
+        size_t length = recordLength(tail);
+        if (copied + length > size) {
+            break;
+        }
+
+        get(tail, &buffer[copied], length);
+        _used -= length;
+        copied += length;
+    }
+
+    return copied;
+}
+
+size_t LoRaTraceRing::used() {
+    return _used;
+}
+
+uint32_t LoRaTraceRing::dropped() {
+    return _dropped;
+}
+
+void LoRaTraceRing::clear() {
+    _head = 0;
+    _used = 0;
+}
+
+void LoRaTraceRing::put(const uint8_t* data, size_t size) {
+    size_t first = _size - _head;
+    if (first > size) {
+        first = size;
+    }
+
+    memcpy(&_storage[_head], data, first);
+    memcpy(_storage, &data[first], size - first);
+
+    _head = (_head + size) % _size;
+    _used += size;
+}
+
+void LoRaTraceRing::get(size_t offset, uint8_t* data, size_t size) {
+    size_t first = _size - offset;
+    if (first > size) {
+        first = size;
+    }
+
+    memcpy(data, &_storage[offset], first);
+    memcpy(&data[first], _storage, size - first);
+}
+
+size_t LoRaTraceRing::recordLength(size_t offset) {
+    return LORA_TRACE_HEADER_LENGTH + _storage[(offset + 1) % _size];
+}
+
+LoRaTraceReader::LoRaTraceReader(const uint8_t* trace, size_t length)
+    : _trace(trace), _length(length), _offset(0) {
+}
+
+bool LoRaTraceReader::next(LoRaTraceRecord* record, const uint8_t** payload) {
+    if (_length - _offset < LORA_TRACE_HEADER_LENGTH) {
+        return false;
+    }
+
+    if (!LoRaTrace::decode(&_trace[_offset], record)) {
+        return false;
+    }
+
+    if (_length - _offset - LORA_TRACE_HEADER_LENGTH < record->length) {
+        return false;
+    }
+
+    *payload = &_trace[_offset + LORA_TRACE_HEADER_LENGTH];
+    _offset += LORA_TRACE_HEADER_LENGTH + record->length;
+
+    return true;
+}
+
+void LoRaTraceReader::rewind() {
+    _offset = 0;
+}
@@ -0,0 +1,129 @@
+// Copyright (c) Sandeep Mistry. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full
+// license information.
+
+// Binary trace of received packets.
+//
+// Each record is a fixed little-endian header followed by the payload:
+//
+//   magic(1) length(1) timestamp_us(8) frequency(4) frequency_error(4)
+//   rssi(2) snr(1) irq_flags(1) spreading_factor(1) coding_rate(1)
+//   bandwidth(4) flags(1) preamble_length(2) payload(length)
+//
+// timestamp_us is the DIO0 (RxDone) interrupt time on the capturing device's
+// LoRaPort::timestamp() clock.
+//
+// This file has no Mbed dependencies so traces drained from a device can be
+// decoded and replayed on a host.
+
+#ifndef LORA_TRACE_H
+#define LORA_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LORA_TRACE_MAGIC         0xa7
+#define LORA_TRACE_HEADER_LENGTH 31
+
+// LoRaTraceRecord::flags
+#define LORA_TRACE_FLAG_CRC_ON          0x01
+#define LORA_TRACE_FLAG_IMPLICIT_HEADER 0x02
+
+struct LoRaTraceRecord {
+    uint64_t timestamp_us;
+    uint32_t frequency;
+    int32_t  frequency_error;
+    int16_t  rssi;
+    int8_t   snr;  // quarter dB, as in REG_PKT_SNR_VALUE
+    uint8_t  irq_flags;
+    uint8_t  spreading_factor;
+    uint8_t  coding_rate;
+    uint32_t bandwidth;
+    uint8_t  flags;
+    uint16_t preamble_length;
+    uint8_t  length;
+};
+
+class LoRaTrace {
+   public:
+    static void encode(const LoRaTraceRecord& record, uint8_t* header);
+    static bool decode(const uint8_t* header, LoRaTraceRecord* record);
+};
+
+// Byte ring of whole records, the oldest records are dropped when full.
+class LoRaTraceRing {
+   public:
+    LoRaTraceRing(uint8_t* storage, size_t size);
+
+    bool append(const LoRaTraceRecord& record, const uint8_t* payload);
+    // copies out as many whole records as fit, returns the bytes written
+    size_t drain(uint8_t* buffer, size_t size);
+
+    size_t   used();
+    uint32_t dropped();
+    void     clear();
+
+   private:
+    void   put(const uint8_t* data, size_t size);
+    void   get(size_t offset, uint8_t* data, size_t size);
+    size_t recordLength(size_t offset);
+
+   private:
+    uint8_t* _storage;
+    size_t   _size;
+    size_t   _head;
+    size_t   _used;
+    uint32_t _dropped;
+};
+
+// Sequential reader over a drained trace.
+class LoRaTraceReader {
+   public:
+    LoRaTraceReader(const uint8_t* trace, size_t length);
+
+    // returns false at the end of the trace or on a malformed record
+    bool next(LoRaTraceRecord* record, const uint8_t** payload);
+    void rewind();
+
+   private:
+    const uint8_t* _trace;
+    size_t         _length;
+    size_t         _offset;
+};
+
+// Feeds a trace to a sink providing
+//
+//   void inject(const LoRaTraceRecord& record, const uint8_t* payload);
+//   void delay(uint32_t ms);
+//
+// keeping the recorded spacing divided by `speedup`; a speedup of 0 replays
+// back to back. Returns the number of records replayed.
+class LoRaTraceReplayer {
+   public:
+    template <typename Sink>
+    static size_t replay(const uint8_t* trace, size_t length, Sink& sink,
+                         uint32_t speedup = 1) {
+        LoRaTraceReader reader(trace, length);
+        LoRaTraceRecord record;
+        const uint8_t*  payload;
+        uint64_t        previous = 0;
+        size_t          count = 0;
+
+        while (reader.next(&record, &payload)) {
+            if (speedup && count > 0) {
+                uint32_t gap = (record.timestamp_us - previous) / 1000;
+                if (gap / speedup) {
+                    sink.delay(gap / speedup);
+                }
+            }
+            previous = record.timestamp_us;
+
+            sink.inject(record, payload);
+            count++;
+        }
+
+        return count;
+    }
+};
+
+#endif